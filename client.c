@@ -1,186 +1,295 @@
-#include <stdio.h>
-#include <signal.h>
-#include <stdlib.h>
-#include <string.h>
-#include <sys/types.h>
-#include <sys/socket.h>
-#include <sys/select.h>
-#include <netinet/in.h>
-#include <unistd.h>
-#include <netdb.h>
-#include <arpa/inet.h>
-
-void irc_free(int sockfd);
-int irc_connect(char *host, char *port);
-struct addrinfo *servinfo;
-static int MAX_MESSAGE_SIZE = 512;
-
-int main(int argc, char *argv[])
-{
-        int status;     
-        char *host = "127.0.0.1";           //default ip
-        char *port = "6667";                //same port as server
-        int sock = irc_connect(host, port); //set up socket
-        if (sock == -1) 
-        {
-                perror("socket");
-                return -1;
-        }
-
-        int fd = STDOUT_FILENO; 
-        if (sock > fd) 
-        {
-                fd = sock;
-        }
-        fd++;
-
-        int select_fd;
-        while (1) 
-        {
-                fd_set rfds;    //read fd
-                fd_set wfds;    //write fd
-        
-                FD_SET(STDIN_FILENO, &rfds);                    //set read fd
-                FD_SET(sock, &rfds);
-                FD_SET(STDOUT_FILENO, &wfds);                   //set write fd
-                FD_SET(sock, &wfds);
-
-                select_fd = select(fd, &rfds, &wfds, NULL, NULL);     //monitor read and write file descriptors and update select_fd
-                if (select_fd == -1) 
-                {
-                        perror("ERROR: error with select()");
-                        irc_free(sock);
-                        return -1;
-                }
-
-                if (FD_ISSET(STDIN_FILENO, &rfds))  //read input
-                {
-                        ssize_t read_buf;
-                        char inbuf[MAX_MESSAGE_SIZE + 2];
-                        memset(&inbuf, 0, sizeof inbuf);        //allocate resources for read
-                        read_buf = read(STDOUT_FILENO, inbuf, MAX_MESSAGE_SIZE);
-                        if (read_buf < 1) 
-                        {
-                                perror("ERROR: read error");
-                                irc_free(sock);
-                                return -1;
-                        }
-                        if (inbuf[read_buf-1] == '\n')  //formatting message
-                        {
-                                inbuf[read_buf-1] = '\r';
-                                inbuf[read_buf] = '\n';
-                        }
-
-                        //make sure that socket can be written to
-                        if (!FD_ISSET(sock, &wfds)) 
-                        {
-                                //select on sock for writing
-                                fd_set wfds_sock;
-                                FD_SET(sock, &wfds_sock);
-                                select_fd = select(sock + 1, NULL, &wfds_sock, NULL, NULL); //monitor write file descriptors and update select_fd
-                                if (select_fd == -1) 
-                                {
-                                        perror("error with select()");
-                                        irc_free(sock);
-                                        return -1;
-                                }
-                        }
-
-                        //write to the socket
-                        read_buf = send(sock, inbuf, read_buf+1, 0);
-                        if (read_buf == -1) 
-                        {
-                                perror("ERROR: error while sending");
-                                irc_free(sock);
-                                return -1;
-                        }
-                }
-                if (FD_ISSET(sock, &rfds))  //if file descriptor is set
-                {
-                        //read the socket
-                        ssize_t read_buf;
-                        char buf[MAX_MESSAGE_SIZE + 1];
-                        memset(&buf, 0, sizeof buf);
-                        read_buf = recv(sock, (void *) &buf, MAX_MESSAGE_SIZE, 0);
-                        if (read_buf < 1) 
-                        {
-                                perror("Exiting");
-                                irc_free(sock);
-                                return -1;
-                        }
-                        if (buf[MAX_MESSAGE_SIZE] != '\0')          //message was too large
-                        {
-                                char overbuf[MAX_MESSAGE_SIZE];
-                                while (read_buf == MAX_MESSAGE_SIZE)
-                                {
-                                        read_buf = recv(sock, (void *) &overbuf, MAX_MESSAGE_SIZE, 0);  //recieve the rest of the message
-                                        if (read_buf < 1) 
-                                        {
-                                                perror("ERROR: error with recv() overbuf");
-                                                irc_free(sock);
-                                                return -1;
-                                        }
-                                }
-                        }
-                        //check to see if we can write to stdout
-                        if (FD_ISSET(STDOUT_FILENO, &wfds)) //if write fd is set
-                        {
-                                //select on stdout for writing 
-                                fd_set wfds_stdout;
-                                FD_SET(STDOUT_FILENO, &wfds_stdout);
-                                select_fd = select(STDOUT_FILENO + 1, NULL, &wfds_stdout, NULL, NULL);
-                                if (select_fd == -1) 
-                                {
-                                        perror("select");
-                                        return -1;
-                                }
-                        }
-                        //write to stdout
-                        printf("%s", buf);
-                }
-        }         
-        irc_free(sock); //free resources
-        return 0;
-}
-
-//connect to the irc server
-int irc_connect(char *host, char *port)
-{
-        //set up socket
-        struct addrinfo irc_server;
-        memset(&irc_server, 0, sizeof irc_server);  
-        irc_server.ai_family = AF_INET;
-        irc_server.ai_socktype = SOCK_STREAM;
-        int status = getaddrinfo(host, port, &irc_server, &servinfo);
-        if (status == -1) 
-        {
-                perror("ERROR: error getting address info");
-                return -1;
-        }
-        
-        int sock = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
-        if (sock == -1) 
-        {
-                freeaddrinfo(servinfo);
-                perror("ERRIR: error with socket()");
-                return -1;
-        }
-        status = connect(sock, servinfo->ai_addr, servinfo->ai_addrlen);
-        if (status == -1) 
-        {
-                perror("ERROR: error with connect()");
-                irc_free(sock);
-                return -1;
-        }  
-        return sock;
-}
-
-//close connection and free resources
-void irc_free(int sockfd)
-{
-        freeaddrinfo(servinfo);
-        if (close(sockfd) == -1) 
-        {
-                perror("ERROR: error with close()");
-        }        
-}
\ No newline at end of file
+#include <stdio.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+
+#define BUF_SZ 65536            //bytes buffered in each direction
+#define MAX_MESSAGE_SIZE 512    //longest line sent to the server, longer input is split
+#define CHUNK_SZ 4096           //bytes written to stdout per wakeup, a pipe takes that without blocking
+
+//bytes waiting to be written somewhere
+typedef struct {
+        char data[BUF_SZ];
+        size_t len;
+} buf_t;
+
+void irc_free(int sockfd);
+int irc_connect(char *host, char *port);
+struct addrinfo *servinfo;
+
+static buf_t lines;             //stdin not yet ending in a newline
+static buf_t to_server;         //complete lines not yet sent
+static buf_t to_stdout;         //server output not yet printed
+static size_t scanned;          //bytes of to_stdout already checked for PINGs
+
+//write what fd takes of b without blocking on it, -1 on error
+static int buf_flush(int fd, buf_t *b, size_t max)
+{
+        size_t n = b->len < max ? b->len : max;
+        ssize_t w = write(fd, b->data, n);
+        if (w < 0)
+        {
+                return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+        }
+        b->len -= w;
+        memmove(b->data, b->data + w, b->len);
+        if (b == &to_stdout)
+        {
+                scanned = (size_t)w < scanned ? scanned - w : 0;
+        }
+        return 0;
+}
+
+//answer the server's PINGs with /pong and keep them off the screen; only
+//whole lines are looked at, the last one may still be arriving
+static void answer_pings(void)
+{
+        char *line = to_stdout.data + scanned;
+        char *end = to_stdout.data + to_stdout.len;
+        char *nl;
+
+        while ((nl = memchr(line, '\n', end - line)))
+        {
+                size_t len = nl + 1 - line;
+                if ((len == 5 || (len == 6 && line[4] == '\r')) && !memcmp(line, "PING", 4) &&
+                    to_server.len + 7 <= BUF_SZ)
+                {
+                        memcpy(to_server.data + to_server.len, "/pong\r\n", 7);
+                        to_server.len += 7;
+                        memmove(line, nl + 1, end - nl - 1);
+                        end -= len;
+                        to_stdout.len -= len;
+                        continue;
+                }
+                line = nl + 1;
+        }
+        scanned = line - to_stdout.data;
+}
+
+//move every complete input line to the server buffer, ending it in \r\n;
+//a line longer than MAX_MESSAGE_SIZE is cut into several, and at end of
+//input the unterminated tail is sent as a line of its own
+static void frame_lines(int eof)
+{
+        char *line = lines.data;
+        char *end = lines.data + lines.len;
+
+        while (line < end && to_server.len + MAX_MESSAGE_SIZE + 2 <= BUF_SZ)
+        {
+                char *nl = memchr(line, '\n', end - line);
+                char *next;
+                if (nl && nl - line <= MAX_MESSAGE_SIZE)
+                {
+                        next = nl + 1;
+                }
+                else if (end - line >= MAX_MESSAGE_SIZE)
+                {
+                        nl = next = line + MAX_MESSAGE_SIZE;    //overlong, split it
+                }
+                else if (eof)
+                {
+                        nl = next = end;
+                }
+                else
+                {
+                        break;          //wait for the rest of the line
+                }
+                if (nl > line && nl[-1] == '\r')
+                {
+                        nl--;
+                }
+                memcpy(to_server.data + to_server.len, line, nl - line);
+                to_server.len += nl - line;
+                memcpy(to_server.data + to_server.len, "\r\n", 2);
+                to_server.len += 2;
+                line = next;
+        }
+        lines.len = end - line;
+        memmove(lines.data, line, lines.len);
+}
+
+int main(int argc, char *argv[])
+{
+        char *host = "127.0.0.1";           //default ip
+        char *port = "6667";                //same port as server
+        int pipe_mode = 0;                  //scripted: quiet, and wait for replies after end of input
+        int linger_ms = 1000;               //how long pipe mode waits for more output
+        int opt;
+
+        while ((opt = getopt(argc, argv, "h:p:nw:")) != -1)
+        {
+                switch (opt)
+                {
+                case 'h':   //server address
+                        host = optarg;
+                        break;
+                case 'p':   //server port
+                        port = optarg;
+                        break;
+                case 'n':   //non-interactive pipe mode
+                        pipe_mode = 1;
+                        break;
+                case 'w':   //pipe mode wait for output after end of input, ms
+                        linger_ms = atoi(optarg);
+                        break;
+                default:
+                        fprintf(stderr, "usage: %s [-h host] [-p port] [-n] [-w linger ms]\n", argv[0]);
+                        return -1;
+                }
+        }
+        signal(SIGPIPE, SIG_IGN);
+
+        int sock = irc_connect(host, port); //set up socket
+        if (sock == -1)
+        {
+                return -1;
+        }
+        fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+
+        int stdin_open = 1;
+        int half_closed = 0;
+        while (1)
+        {
+                //only poll for what can make progress, so an idle client sleeps
+                struct pollfd pfd[3];
+                pfd[0].fd = stdin_open && lines.len < BUF_SZ && to_server.len + MAX_MESSAGE_SIZE + 2 <= BUF_SZ ? STDIN_FILENO : -1;
+                pfd[0].events = POLLIN;
+                pfd[1].fd = sock;
+                pfd[1].events = (to_stdout.len < BUF_SZ ? POLLIN : 0) | (to_server.len ? POLLOUT : 0);
+                pfd[2].fd = to_stdout.len ? STDOUT_FILENO : -1;
+                pfd[2].events = POLLOUT;
+
+                //end of input and everything sent: stop writing and give the server time to answer
+                if (!stdin_open && !lines.len && !to_server.len && !half_closed)
+                {
+                        if (!pipe_mode)
+                        {
+                                break;
+                        }
+                        shutdown(sock, SHUT_WR);
+                        half_closed = 1;
+                }
+                int n = poll(pfd, 3, half_closed && !to_stdout.len ? linger_ms : -1);
+                if (n < 0)
+                {
+                        if (errno == EINTR)
+                        {
+                                continue;
+                        }
+                        perror("ERROR: error with poll()");
+                        break;
+                }
+                if (n == 0)
+                {
+                        break;          //pipe mode: no more output
+                }
+
+                if (pfd[0].revents & (POLLIN | POLLHUP | POLLERR))  //read input
+                {
+                        ssize_t rlen = read(STDIN_FILENO, lines.data + lines.len, BUF_SZ - lines.len);
+                        if (rlen < 0 && errno != EINTR)
+                        {
+                                perror("ERROR: read error");
+                                break;
+                        }
+                        if (rlen == 0)
+                        {
+                                stdin_open = 0;
+                        }
+                        if (rlen > 0)
+                        {
+                                lines.len += rlen;
+                        }
+                }
+                frame_lines(!stdin_open);
+
+                if ((pfd[1].revents & (POLLIN | POLLHUP | POLLERR)) && to_stdout.len < BUF_SZ)  //read the socket
+                {
+                        ssize_t rlen = recv(sock, to_stdout.data + to_stdout.len, BUF_SZ - to_stdout.len, 0);
+                        if (rlen == 0 || (rlen < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+                        {
+                                if (!pipe_mode)
+                                {
+                                        fprintf(stderr, "> disconnected\n");
+                                }
+                                break;
+                        }
+                        if (rlen > 0)
+                        {
+                                to_stdout.len += rlen;
+                                answer_pings();
+                        }
+                }
+                if ((pfd[1].revents & POLLOUT) && buf_flush(sock, &to_server, to_server.len) < 0)
+                {
+                        perror("ERROR: error while sending");
+                        break;
+                }
+                if ((pfd[2].revents & POLLOUT) && buf_flush(STDOUT_FILENO, &to_stdout, CHUNK_SZ) < 0)
+                {
+                        perror("ERROR: error writing output");
+                        break;
+                }
+                if (pfd[2].revents & (POLLERR | POLLHUP))
+                {
+                        break;          //nobody reads our output any more
+                }
+        }
+
+        //print what is left, stdout is blocking so this waits for the reader
+        while (to_stdout.len && buf_flush(STDOUT_FILENO, &to_stdout, to_stdout.len) == 0);
+        irc_free(sock); //free resources
+        return 0;
+}
+
+//connect to the irc server
+int irc_connect(char *host, char *port)
+{
+        //set up socket
+        struct addrinfo irc_server;
+        memset(&irc_server, 0, sizeof irc_server);
+        irc_server.ai_family = AF_INET;
+        irc_server.ai_socktype = SOCK_STREAM;
+        int status = getaddrinfo(host, port, &irc_server, &servinfo);
+        if (status != 0)
+        {
+                fprintf(stderr, "ERROR: error getting address info: %s\n", gai_strerror(status));
+                servinfo = NULL;
+                return -1;
+        }
+
+        int sock = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
+        if (sock == -1)
+        {
+                freeaddrinfo(servinfo);
+                perror("ERROR: error with socket()");
+                return -1;
+        }
+        status = connect(sock, servinfo->ai_addr, servinfo->ai_addrlen);
+        if (status == -1)
+        {
+                perror("ERROR: error with connect()");
+                irc_free(sock);
+                return -1;
+        }
+        return sock;
+}
+
+//close connection and free resources
+void irc_free(int sockfd)
+{
+        freeaddrinfo(servinfo);
+        if (close(sockfd) == -1)
+        {
+                perror("ERROR: error with close()");
+        }
+}
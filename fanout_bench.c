@@ -0,0 +1,97 @@
+// Fan-out benchmark: cost of one chat line to a small room while
+// unrelated rooms fill up. Builds the server in-process so it measures
+// message() itself, recipients write to /dev/null.
+#define main irc_main
+#include "irc.c"
+#undef main
+
+#include <fcntl.h>
+
+#define ROOM_SIZE 5             // members of the measured room
+#define ITERATIONS 100000       // messages sent per step
+#define SCAN_ITERATIONS 1000    // the scan walks every slot, keep it short
+#define OTHER_ROOMS 1000        // unrelated rooms the other users are spread over
+
+static const int steps[] = { 0, 1000, 5000, 20000, 50000 };
+
+//add n clients to the server, in room or spread over OTHER_ROOMS others when room is NULL
+static void add_clients(int n, const char *room, int fd)
+{
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    for (int i = 0; i < n; i++)
+    {
+        client_t *cl = client_alloc(fd, &addr);
+        if (room)
+        {
+            snprintf(cl->room, sizeof(cl->room), "%s", room);
+        }
+        else
+        {
+            snprintf(cl->room, sizeof(cl->room), "other%d", i % OTHER_ROOMS);
+        }
+        queue_add(cl);
+        cl->reactor = &reactors[0];     //no worker threads here, play the owning one
+        room_join(cl, 1);
+    }
+}
+
+//old behaviour for comparison: scan every client and compare the room
+static void message_scan(msg_t *m, int uid, const char *room)
+{
+    pthread_rwlock_rdlock(&clients_lock);
+    for (unsigned int i = 0; i < client_count; i++)
+    {
+        if (!strcmp(clients[i]->room, room) && clients[i]->uid != uid)
+        {
+            client_send(clients[i], m);
+        }
+    }
+    pthread_rwlock_unlock(&clients_lock);
+    msg_unref(m);
+}
+
+int main(void)
+{
+    char line[] = "> [bench] the quick brown fox jumps over the lazy dog\r\n";
+    int fd = open("/dev/null", O_WRONLY);
+    if (fd < 0)
+    {
+        perror("open /dev/null");
+        return EXIT_FAILURE;
+    }
+
+    nreactors = 1;
+    reactors = calloc(1, sizeof(reactor_t));
+    add_clients(ROOM_SIZE, "bench", fd);
+    int sender = clients[0]->uid;
+    room_t *room = clients[0]->room_ptr;
+    int idle = 0;
+
+    printf("room of %d, %d messages per step (%d with the old client scan)\n",
+           ROOM_SIZE, ITERATIONS, SCAN_ITERATIONS);
+    printf("%12s %14s %14s\n", "other users", "indexed ns/msg", "scan ns/msg");
+    for (unsigned int i = 0; i < sizeof(steps) / sizeof(steps[0]); i++)
+    {
+        add_clients(steps[i] - idle, 0, fd);
+        idle = steps[i];
+
+        unsigned long t0 = now_ns();
+        for (int j = 0; j < ITERATIONS; j++)
+        {
+            message(msg_new(line, sizeof(line) - 1), sender, room);
+        }
+        unsigned long t1 = now_ns();
+        for (int j = 0; j < SCAN_ITERATIONS; j++)
+        {
+            message_scan(msg_new(line, sizeof(line) - 1), sender, "bench");
+        }
+        unsigned long t2 = now_ns();
+
+        printf("%12d %14.1f %14.1f\n", idle,
+               (double)(t1 - t0) / ITERATIONS, (double)(t2 - t1) / SCAN_ITERATIONS);
+        fflush(stdout);
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -1,408 +1,5411 @@
-#include <sys/socket.h>
-#include <netinet/in.h>
-#include <arpa/inet.h>
-#include <stdio.h>
-#include <stdlib.h>
-#include <unistd.h>
-#include <errno.h>
-#include <string.h>
-#include <pthread.h>
-#include <sys/types.h>
-#include <signal.h>
-
-
-#define MAX_CLIENTS 50
-#define BUFFER_SZ 2048
-
-static unsigned int client_count = 0;   //number of clients in server
-static int uid = 100;                   // user id number
-static int roomid = 1;                  //default room id
-
-// Client struct
-typedef struct {
-    struct sockaddr_in addr;    // Client remote address 
-    int connfd;                 // Connection file descriptor 
-    int uid;                    // Client unique identifier 
-    int roomid;                 // Client room id
-    char name[32];              // Client name 
-} client_t;
-
-client_t *clients[MAX_CLIENTS];                             //init client_t struct
-pthread_mutex_t clients_mutex = PTHREAD_MUTEX_INITIALIZER;  //init threading
-
-//function prototyping
-void *handle_client(void *arg);
-void queue_add(client_t *cl);
-void queue_delete(int uid);
-void message(char *s, int uid, int room_id);
-void message_all(char *s);
-void message_self(const char *s, int connfd);
-void message_client(char *s, int uid);
-void active_clients(int connfd);
-void strip_newline(char *s);
-void *handle_client(void *arg);
-
-
-
-int main(int argc, char *argv[])
-{
-    int listenfd = 0, connfd = 0;
-    struct sockaddr_in serv_addr;
-    struct sockaddr_in cli_addr;
-    pthread_t tid;
-
-    //set up socket
-    listenfd = socket(AF_INET, SOCK_STREAM, 0);
-    serv_addr.sin_family = AF_INET;
-    serv_addr.sin_addr.s_addr = htonl(INADDR_ANY);
-    serv_addr.sin_port = htons(6667);
-    signal(SIGPIPE, SIG_IGN);
-
-    //bind socket
-    if (bind(listenfd, (struct sockaddr*)&serv_addr, sizeof(serv_addr)) < 0) 
-    {
-        perror("Socket binding failed");
-        return EXIT_FAILURE;
-    }
-
-    //listen
-    if (listen(listenfd, 10) < 0) {
-        perror("Socket listening failed");
-        return EXIT_FAILURE;
-    }
-    printf("> Server started!\n");
-
-    //accept and handle clients
-    while (1) 
-    {
-        socklen_t clientlength = sizeof(cli_addr);
-        connfd = accept(listenfd, (struct sockaddr*)&cli_addr, &clientlength);
-
-        if ((client_count + 1) == MAX_CLIENTS)     //don't go past max number of clients
-        {
-            printf("> ERROR: max clients reached\n");
-            close(connfd);
-            continue;
-        }
-
-        //initialize client details
-        client_t *my_client = (client_t *)malloc(sizeof(client_t));
-        my_client ->addr = cli_addr;    //set address
-        my_client ->roomid = roomid;    //set to default value of 1
-        my_client ->connfd = connfd;    //unique fd for each client
-        my_client ->uid = uid++;        //increment and store uid
-        sprintf(my_client ->name, "%d", my_client ->uid);
-
-        //Add client to the queue and fork thread
-        queue_add(my_client);
-        pthread_create(&tid, NULL, &handle_client, (void*)my_client);
-
-        sleep(1);   //performance optimization
-    }
-
-    return EXIT_SUCCESS;
-}
-
-
-// Add client to queue
-void queue_add(client_t *cl)
-{
-    pthread_mutex_lock(&clients_mutex);
-    for (int i = 0; i < MAX_CLIENTS; i++) 
-    {
-        if (!clients[i])           // = null
-        {
-            clients[i] = cl;
-            break;
-        }
-    }
-    pthread_mutex_unlock(&clients_mutex);
-}
-
-//Delete the client from queue 
-void queue_delete(int uid)
-{
-    pthread_mutex_lock(&clients_mutex);
-    for (int i = 0; i < MAX_CLIENTS; i++) 
-    {
-        if (clients[i])     //is valid
-        {
-            if (clients[i]->uid == uid) {
-                clients[i] = NULL;
-                break;
-            }
-        }
-    }
-    pthread_mutex_unlock(&clients_mutex);
-}
-
-//message all but the sender who are in same room
-void message(char *s, int uid, int room_id)
-{
-    pthread_mutex_lock(&clients_mutex);
-    for (int i = 0; i < MAX_CLIENTS; i++) 
-    {
-        if (clients[i])                         //if valid client
-        {
-            if (clients[i]->roomid == room_id)  //if in same room
-            {
-                if (clients[i]->uid != uid)     //if not self
-                {
-                    if (write(clients[i]->connfd, s, strlen(s)) < 0)
-                    {
-                        perror("Write to descriptor failed");   //error checking
-                        break;
-                    }
-                }
-            }
-        }
-    }
-    pthread_mutex_unlock(&clients_mutex);
-}
-
-//message all
-void message_all(char *s)
-{
-    pthread_mutex_lock(&clients_mutex);
-    for (int i = 0; i <MAX_CLIENTS; i++)
-    {
-        if (clients[i])     //if valid client
-        {
-            if (write(clients[i]->connfd, s, strlen(s)) < 0) 
-            {
-                perror("Write to descriptor failed");
-                break;
-            }
-        }
-    }
-    pthread_mutex_unlock(&clients_mutex);
-}
-
-// message sender
-void message_self(const char *s, int connfd)
-{
-    if (write(connfd, s, strlen(s)) < 0) 
-    {
-        perror("Write to descriptor failed");
-        exit(-1);
-    }
-}
-
-//Message select client
-void message_client(char *s, int uid)
-{
-    pthread_mutex_lock(&clients_mutex);
-    for (int i = 0; i < MAX_CLIENTS; i++)
-    {
-        if (clients[i])                     //if valid client
-        { 
-            if (clients[i]->uid == uid)     //if correct uid
-            {
-                if (write(clients[i]->connfd, s, strlen(s))<0) 
-                {
-                    perror("Write to descriptor failed");
-                    break;
-                }
-            }
-        }
-    }
-    pthread_mutex_unlock(&clients_mutex);
-}
-
-//List all active clients
-void active_clients(int connfd)
-{
-    char s[64];
-    pthread_mutex_lock(&clients_mutex);
-
-    for (int i = 0; i < MAX_CLIENTS; i++)
-    {
-        if (clients[i]) 
-        {
-            sprintf(s, "[%d] %s - room: %d\r\n", clients[i]->uid, clients[i]->name,clients[i]->roomid);
-            message_self(s, connfd);
-        }
-    }
-    pthread_mutex_unlock(&clients_mutex);
-}
-
-//Parse string of characters for correct formatting
-void strip_newline(char *s)
-{
-    while (*s != '\0') 
-    {
-        if (*s == '\r' || *s == '\n') 
-        {
-            *s = '\0';
-        }
-        s++;
-    }
-}
-
-//Handle all client messaging and "/" commands
-void *handle_client(void *arg)
-{
-    char buff_out[BUFFER_SZ];
-    char buff_in[BUFFER_SZ / 2];
-    int rlen;                           //read length
-
-    client_count++;
-    client_t *my_client = (client_t *)arg;
-
-    printf("Client number [%d] has joined\n", my_client ->uid);         //server info
-    sprintf(buff_out, "[%s] has joined\r\n", my_client ->name);         //create message broadcast to all
-    message_all(buff_out);                                              //broadcast to all clients
-    message_self("> see /help for a list of commands\r\n>", my_client ->connfd);
-
-    //endless loop for each client that recieves all inputs
-    while ((rlen = read(my_client ->connfd, buff_in, sizeof(buff_in) - 1)) > 0) 
-    {
-        buff_in[rlen] = '\0';   //initialize
-        buff_out[0] = '\0';     
-        strip_newline(buff_in);
-
-        // Ignore input if empty
-        if (!strlen(buff_in)) 
-        {
-            continue;
-        }
-
-        // "/" character read, check for command
-        if (buff_in[0] == '/') 
-        {
-            char *command, *param;
-            command = strtok(buff_in," ");
-            if (!strcmp(command, "/quit"))      //user wants to quit
-            {
-                break;
-            } 
-            else if (!strcmp(command, "/test")) //test server
-            {
-                message_self("> *boop*\r\n> ", my_client ->connfd);
-            } 
-            else if (!strcmp(command, "/nick")) //change nickname
-            {
-                param = strtok(NULL, " ");
-                if (param) {
-                    char *old_name = strdup(my_client ->name);
-                    if (!old_name) {
-                        perror("Cannot allocate memory");
-                        continue;
-                    }
-                    strcpy(my_client ->name, param);
-                    sprintf(buff_out, "> user [%s] is now known as [%s]\r\n", old_name, my_client ->name);
-                    free(old_name);
-                    message_all(buff_out);
-                } 
-                else 
-                {
-                    message_self("> name cannot be empty\r\n", my_client ->connfd);
-                }
-            } 
-            else if (!strcmp(command, "/room"))     //change room (between 1 and 5)
-            {
-                param = strtok(NULL, " ");
-                if (param) 
-                {
-                    int num = atoi(param);
-                    if (num > 0 && num < 6)
-                    {
-                        my_client ->roomid = num;
-                        if (!my_client ->name)
-                        {
-                            sprintf(buff_out, "> [%d] is now in room number %d\r\n", my_client ->uid, my_client ->roomid);
-                            message_all(buff_out);
-                        }
-                        else
-                        {
-                            sprintf(buff_out, "> [%s] is now in room number %d\r\n", my_client ->name, my_client ->roomid);
-                            message_all(buff_out);
-                        }
-                    }
-                    else 
-                    {
-                        message_self("> invalid room, pick a number between 1 and 5.\r\n", my_client ->connfd);
-                    }
-                } 
-                else 
-                {
-                    message_self("> invalid room, pick a number between 1 and 5.\r\n", my_client ->connfd);
-                }
-            } 
-            else if (!strcmp(command, "/whisper"))  //send a private message to a select client
-            {
-                param = strtok(NULL, " ");
-                if (param) 
-                {
-                    int uid = atoi(param);
-                    param = strtok(NULL, " ");
-                    if (param) 
-                    {
-                        sprintf(buff_out, "> [%s][whisper]", my_client ->name);
-                        while (param != NULL) 
-                        {
-                            strcat(buff_out, " ");
-                            strcat(buff_out, param);
-                            param = strtok(NULL, " ");
-                        }
-                        strcat(buff_out, "\r\n");
-                        message_client(buff_out, uid);
-                    } 
-                    else 
-                    {
-                        message_self("> message cannot be null\r\n", my_client ->connfd);
-                    }
-
-                } 
-                else 
-                {
-                    message_self("> message cannot be null\r\n", my_client ->connfd);
-                }
-            } 
-            else if(!strcmp(command, "/list"))      //view all active client memebers and their room id
-            {
-                sprintf(buff_out, "=============================\nClients in server: %d\r\n", client_count);
-                message_self(buff_out, my_client ->connfd);
-                active_clients(my_client ->connfd);
-                sprintf(buff_out, "=============================\r\n");
-                message_self(buff_out, my_client ->connfd);
-            } 
-            else if (!strcmp(command, "/help"))     //display all commands
-            {
-                strcat(buff_out, "===============================================================\r\n");
-                strcat(buff_out, ">  /quit     Quit chatroom                                    <\r\n");
-                strcat(buff_out, ">  /test     Server test                                      <\r\n");
-                strcat(buff_out, ">  /room     <room number> change chat room                   <\r\n");
-                strcat(buff_out, ">  /nick     <name> Change nickname                           <\r\n");
-                strcat(buff_out, ">  /whisper  <user id> <message> Send private message         <\r\n");
-                strcat(buff_out, ">  /list     Show active clients                              <\r\n");
-                strcat(buff_out, ">  /help     Show help                                        <\r\n");
-                strcat(buff_out, "===============================================================\r\n> ");
-                message_self(buff_out, my_client ->connfd);
-            } 
-            else 
-            {
-                message_self("> unknown command\r\n", my_client ->connfd);
-            }
-        } 
-        else    //user just wants to send a normal message
-        {
-            snprintf(buff_out, sizeof(buff_out), "> [%s] %s\r\n", my_client ->name, buff_in);
-            message(buff_out, my_client ->uid,my_client ->roomid);
-        }
-    }
-
-    //close connection
-    sprintf(buff_out, "[%s] has left\r\n", my_client ->name);
-    message_all(buff_out);
-    close(my_client ->connfd);
-
-    //delete client from queue and free resources
-    queue_delete(my_client ->uid);
-    printf("Client number [%d] has left the chat\n", my_client ->uid);
-    free(my_client);
-    client_count--;
-    pthread_detach(pthread_self());
-
-    return NULL;
-}
+#define _GNU_SOURCE
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <netdb.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <sys/resource.h>
+#include <stddef.h>
+#include <time.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <limits.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#endif
+#endif
+
+//USDT probes in the "irc" provider, a nop until perf or bpftrace attach;
+//compiled out where systemtap's sdt.h is not installed
+#ifdef DTRACE_PROBE5
+#define PROBE2(name, a, b) DTRACE_PROBE2(irc, name, a, b)
+#define PROBE4(name, a, b, c, d) DTRACE_PROBE4(irc, name, a, b, c, d)
+#define PROBE5(name, a, b, c, d, e) DTRACE_PROBE5(irc, name, a, b, c, d, e)
+#else
+#define PROBE2(name, a, b) do { } while (0)
+#define PROBE4(name, a, b, c, d) do { } while (0)
+#define PROBE5(name, a, b, c, d, e) do { } while (0)
+#endif
+
+
+#define SLAB_CLIENTS 256                //client_t objects per slab
+#define MAX_SLABS 4096                  //slab directory size, caps the server at 1M clients
+#define ROOM_NAME_SZ 32                 //longest room name plus terminator
+#define ROOM_BUCKETS_MIN 64             //initial size of a worker's room table
+#define BUFFER_SZ 2048
+#define MAX_EVENTS 64                   //epoll events per wakeup
+#define OUTQ_DEFAULT 256                //default outbound queue length per client
+#define IOV_BATCH 64                    //queued messages handed to one writev()
+#define URING_IOV 8                     //queued messages handed to one io_uring writev, kept in client_t
+#define URING_ENTRIES 4096              //submission queue entries per worker ring
+#define MAX_ACCEPTORS 64                //listening sockets, all passed in one message on a hot restart
+#define HANDOFF_OUT_MAX 65536           //unsent output carried over per client on a hot restart
+#define HANDOFF_MAGIC 0x69726375        //first word of a hot restart handover
+#define BACKLOG_DEFAULT 4096            //default listen() backlog
+#define FRAME_HDR 12                    //binary frame header bytes
+#define CAPTURE_BUF 65536               //capture bytes a worker gathers before writing them out
+#define CAPTURE_FLUSH_NS 1000000000UL   //longest a worker keeps captured input unwritten
+#define CAPTURE_MAGIC "IRCCAP1\n"       //first bytes of a capture file
+#define ACCEPT_BATCH 256                //connections accepted per listener wakeup
+#define HIST_BUCKETS 32                 //log2 histogram buckets, the last one is open ended
+#define STATS_SZ 8192                   //room for one stats dump
+#define LIST_PAGE 100                   //clients shown per /list page
+#define SCROLLBACK_SZ 16384             //bytes of recent lines kept per room
+#define SCROLLBACK_MAGIC 0x69726362     //marks an initialized scrollback segment
+#define TICK_NS 1000000000UL            //timer wheel resolution
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)   //slots per timer wheel level
+#define WHEEL_LEVELS 3                  //each level spans WHEEL_SLOTS of the one below, 3 days in all
+#define PING_DEFAULT 120                //seconds idle before a PING
+#define PONG_DEFAULT 60                 //seconds to answer it
+#define STALL_DEFAULT 60                //seconds a client may take no output at all
+#define MAX_LINKS 16                    //server-to-server links per process
+#define UID_SPAN 1000000                //user ids each node of a federation hands out
+#define MAX_NODE 2000                   //highest node id, keeps uids in an int
+#define LINK_BUF_MAX (8 << 20)          //bytes buffered per link direction before it is dropped
+#define LINK_RETRY_MS 2000              //redial interval of outgoing links
+#define LINK_SECRET_SZ 128              //longest link secret plus terminator
+#define REMOTE_BUCKETS 65536            //remote user hash buckets, power of two
+#define REMOTE_ROOM_BUCKETS 4096        //remote room hash buckets, power of two
+#define LOG_RING 1024                   //records per thread log ring, power of two
+#define LOG_TEXT_SZ 232                 //longest log message, longer ones are cut
+#define LOG_BATCH_MS 10                 //the log writer lets records gather this long after a wakeup
+#define LOG_OUT_SZ 65536                //log writer output buffer per stream
+#define TRACE_EVERY_DEFAULT 1000        //one message in this many goes to the trace file
+
+// What to do when a client's outbound queue is full
+enum overflow_policy {
+    OVERFLOW_DROP,              // drop the oldest unsent message
+    OVERFLOW_DISCONNECT         // disconnect the slow consumer
+};
+
+// What to do with a line when a flood control bucket is empty
+enum flood_policy {
+    FLOOD_DELAY,                // stop reading the client until a token is back
+    FLOOD_DROP,                 // discard the line
+    FLOOD_DISCONNECT            // disconnect the flooder
+};
+
+// Binary framing, switched to with /binary: every frame is a FRAME_HDR byte
+// header, then the room name and the payload; integers in network byte order
+//   u32 len    whole frame, header included
+//   u8  op     enum frame_op
+//   u8  rlen   room name bytes, 0 from clients
+//   u16        zero
+//   u32 uid    sender, or the recipient of a FRAME_PRIV a client sends
+// A client's FRAME_CHAT and FRAME_PRIV payload is a batch of messages, each a
+// u16 length and its text; every other frame carries a single text
+enum frame_op {
+    FRAME_RAW,                  // msg_t only: data is a whole frame already
+    FRAME_CHAT,                 // Chat line in a room
+    FRAME_PRIV,                 // Whisper
+    FRAME_TEXT,                 // Any other line: a server notice, or a command from the client
+    FRAME_HELLO                 // First frame after switching, uid and room of the client
+};
+
+// Token bucket limit, rate 0 means unlimited
+typedef struct {
+    double rate;                // Tokens added per second
+    double burst;               // Most tokens the bucket holds
+} limit_t;
+
+// Token bucket, one token per line
+typedef struct {
+    double tokens;              // Tokens left
+    unsigned long last_ns;      // When tokens was last brought up to date
+} bucket_t;
+
+static unsigned int client_count = 0;   //number of clients in server
+static unsigned int max_clients = 0;    //client limit, 0 means as many as descriptors allow
+static atomic_int uid = 100;            // user id number
+static const char *default_room = "1";  //room new clients start in
+static int outq_limit = OUTQ_DEFAULT;   //outbound queue length per client
+static enum overflow_policy overflow = OVERFLOW_DROP;
+static const char *oper_password;       //password for /oper, operators are disabled without one
+static const char *log_dir;             //directory of room scrollback segments, memory only without one
+static limit_t client_limit;            //lines per client, any line counts
+static limit_t room_limit;              //chat lines per room
+static enum flood_policy flood = FLOOD_DELAY;
+static int use_uring;                   //io_uring backend requested, epoll is the fallback
+static const char *upgrade_path;        //control socket a new process takes this one over through
+static unsigned long ping_ns = PING_DEFAULT * 1000000000UL;     //idle time before a PING, 0 disables them
+static unsigned long pong_ns = PONG_DEFAULT * 1000000000UL;     //time to answer a PING with any line
+static unsigned long stall_ns = STALL_DEFAULT * 1000000000UL;   //time queued output may go unwritten, 0 allows forever
+static int node_id;                     //this server's node in a federation, picks its uid range
+static int link_port;                   //port other servers link to, 0 accepts no links
+static in_addr_t link_addr = INADDR_LOOPBACK;   //address the link port is bound to
+static const char *link_secret;         //shared by every server of the federation, links need it when set
+static const char *link_peers[MAX_LINKS];   //host:port of the servers this one links to
+static int nlink_peers;                 //number of link_peers
+static int trace_fd = -1;               //sampled message traces, none without one
+static unsigned long trace_every = TRACE_EVERY_DEFAULT;        //sampling interval of the trace file
+static atomic_ulong trace_seq;          //traced messages delivered so far
+static int capture_fd = -1;             //inbound traffic capture, none without one
+static unsigned long capture_t0;        //when the capture started
+
+// Capture file: CAPTURE_MAGIC and the start time as u64 CLOCK_REALTIME ns,
+// then records each followed by len bytes of input, all in host byte order;
+// a worker appends a batch of them at a time, so records are in time order
+// per connection only
+enum capture_kind {
+    CAPTURE_OPEN,               // Connection accepted
+    CAPTURE_DATA,               // Input read from it
+    CAPTURE_CLOSE               // Connection closed
+};
+
+typedef struct {
+    uint64_t ns;                // Since the capture started
+    uint32_t uid;               // Connection
+    uint16_t kind;              // enum capture_kind
+    uint16_t len;               // Bytes of input that follow
+} capture_rec_t;
+
+// Outbound message, formatted once and shared by every recipient queue
+typedef struct msg {
+    atomic_int refs;            // One per queue holding it, plus the creator's
+    unsigned char op;           // enum frame_op binary clients get it as
+    unsigned char room_len;     // Room name stored after data, chat lines only
+    unsigned short body_off;    // Where the text starts after "> [name] "
+    _Atomic(struct msg *) frame;        // Binary form, made for the first binary recipient
+    int uid;                    // Client whose line it answers, traced if line_ns is set
+    unsigned long line_ns;      // When that line was read, 0 for server notices
+    unsigned long parse_ns;     // From reading the line to formatting the message
+    atomic_ulong fanout_ns;     // Time queueing it, summed over the workers doing so
+    atomic_ulong lock_ns;       // Part of fanout_ns spent waiting for queue locks
+    atomic_int sends;           // Queues it was put on
+    size_t len;                 // Message length
+    char data[];                // Message bytes, immutable once published
+} msg_t;
+
+// Work passed to a worker over its lock-free inbox
+enum task_kind {
+    TASK_NEW,                   // Freshly accepted connection
+    TASK_MOVE,                  // Connection moving to the worker that owns its new room
+    TASK_RESTORE,               // Connection taken over from the previous process
+    TASK_BROADCAST,             // Deliver msg to every client of the worker
+    TASK_ROOM,                  // Deliver msg to a room of the worker, relayed from another server
+    TASK_FLUSH                  // Send a client's output on the ring of the worker owning it
+};
+
+typedef struct task {
+    _Atomic(struct task *) next;    // Inbox link
+    enum task_kind kind;        // What to do
+    struct client *cl;          // TASK_NEW, TASK_MOVE, TASK_RESTORE, TASK_FLUSH
+    msg_t *msg;                 // TASK_BROADCAST, TASK_ROOM, holds a reference
+} task_t;
+
+// TASK_ROOM, names the room
+typedef struct {
+    task_t task;                // Inbox entry, first so the task can be freed
+    char room[ROOM_NAME_SZ];    // Room the message is for
+} room_task_t;
+
+// Timer wheel entry, embedded in what it times
+typedef struct wtimer {
+    struct wtimer *next;        // Slot list link
+    struct wtimer **pprev;      // Link pointing at this entry, NULL when not scheduled
+    unsigned long expires;      // Tick it fires at
+} wtimer_t;
+
+// Hierarchical timer wheel: level 0 has a slot per tick, each slot of a higher
+// level spans a whole turn of the level below and is spread over it when the
+// tick gets there, so adding, removing and each tick are O(1)
+typedef struct {
+    wtimer_t *slot[WHEEL_LEVELS][WHEEL_SLOTS];
+    unsigned long tick;         // Next tick to run
+    int count;                  // Scheduled timers
+} wheel_t;
+
+// Client struct
+typedef struct client {
+    struct sockaddr_in addr;    // Client remote address 
+    int connfd;                 // Connection file descriptor 
+    int uid;                    // Client unique identifier 
+    char room[ROOM_NAME_SZ];    // Name of the client's room
+    struct room *room_ptr;      // Member list of that room, owning worker only
+    int room_slot;              // Index in the room's member list
+    int slot;                   // Index in clients[]
+    char name[32];              // Client name 
+    pthread_mutex_t out_lock;   // Guards the outbound queue
+    msg_t **outq;               // Outbound ring buffer of outq_limit entries
+    int out_head;               // Oldest queued message
+    int out_count;              // Number of queued messages
+    size_t out_off;             // Bytes of the oldest message already written
+    int out_inflight;           // Messages handed to an io_uring writev that has not completed
+    int free_pending;           // Closed during that writev or posted flush, whichever ends last frees the client
+    int flush_posted;           // flush sits in the owning worker's inbox
+    unsigned long out_total;    // Bytes ever written, guarded by out_lock
+    unsigned long stall_mark;   // out_total when output was last seen waiting, ~0 when it was not
+    unsigned long stall_ns;     // When stall_mark was taken
+    struct iovec out_iov[URING_IOV];    // Vector of that writev, must outlive the submission
+    int closing;                // Connection is being torn down
+    int oper;                   // Logged in with /oper
+    int binary;                 // Speaks binary frames since /binary; owning worker sets it under out_lock
+    bucket_t flood;             // Flood control, owning worker only
+    unsigned long throttle_ns;  // Input paused until then by flood control, 0 when reading
+    unsigned long last_in_ns;   // When input last arrived
+    int pinged;                 // Sent a PING since then
+    wtimer_t timer;             // Next liveness or write stall check, owning worker only
+    char inbuf[BUFFER_SZ / 2];  // Input not yet split into lines
+    size_t inlen;               // Bytes held in inbuf
+    struct reactor *reactor;    // Worker owning the connection, NULL between workers; set under out_lock
+    int local_slot;             // Index in the owning worker's local[]
+    struct client *next_uid;    // Chain in the uid index
+    struct client *next_free;   // Link in the pool's free list
+    task_t handoff;             // Inbox entry used to pass the client between workers
+    task_t flush;               // Inbox entry asking the owning worker to send, io_uring only
+} client_t;
+
+// Scrollback segment, a mapped file holding this header and then a ring of
+// the room's recent lines; lines are copied in, never written with a syscall
+typedef struct {
+    uint32_t magic;             // SCROLLBACK_MAGIC once initialized
+    uint32_t size;              // Bytes in the ring
+    uint64_t head;              // Bytes ever appended, the next one goes to head % size
+    char data[];                // Ring of recent lines
+} scrollback_t;
+
+// Room struct, members of a room so fan-out only touches that room
+// created on the first join and freed when the last member leaves
+typedef struct room {
+    char name[ROOM_NAME_SZ];    // Room name
+    unsigned int hash;          // Hash of name
+    struct room *next;          // Chain in the owning worker's room table
+    client_t **members;         // Clients currently in the room
+    int count;                  // Number of members
+    int cap;                    // Allocated member slots
+    bucket_t flood;             // Flood control for chat lines
+    scrollback_t *log;          // Recent lines, NULL when the segment could not be mapped
+    msg_t *replay;              // Recent lines as one message, shared by joins until the next line
+} room_t;
+
+// Roster snapshot, every client rendered as one /list line; immutable once
+// published and shared by /list callers until the registry changes
+typedef struct {
+    atomic_int refs;            // One per reader, plus one while it is the current snapshot
+    unsigned long gen;          // roster_gen it was built from
+    unsigned int count;         // Number of clients
+    size_t *offs;               // Start of each line in text, count + 1 entries
+    char text[];                // Rendered lines
+} roster_t;
+
+// One user as copied out of the registry for a roster, formatted unlocked
+typedef struct {
+    int uid;                    // User id
+    char name[32];              // Name
+    char room[ROOM_NAME_SZ];    // Room
+} roster_entry_t;
+
+// Log2 histogram, bucket i counts values below 2^i
+typedef struct {
+    atomic_ulong count[HIST_BUCKETS];
+} hist_t;
+
+// Counters kept by the server: name, description
+#define STATS_COUNTERS(X) \
+    X(accepted,   "connections accepted") \
+    X(rejected,   "connections refused, server full") \
+    X(closed,     "connections closed") \
+    X(lines_in,   "lines received") \
+    X(bytes_in,   "bytes received") \
+    X(msgs_out,   "messages written") \
+    X(bytes_out,  "bytes written") \
+    X(enqueued,   "messages put on outbound queues") \
+    X(dequeued,   "messages taken off outbound queues") \
+    X(dropped,    "messages dropped by a full outbound queue") \
+    X(slow_kills, "clients disconnected by a full outbound queue") \
+    X(flood_delayed, "lines held back by flood control") \
+    X(flood_dropped, "lines dropped by flood control") \
+    X(flood_kills, "clients disconnected by flood control") \
+    X(pings,      "PINGs sent to idle clients") \
+    X(ping_kills, "clients disconnected for not answering a PING") \
+    X(stall_kills, "clients disconnected by output making no progress") \
+    X(log_dropped, "log records dropped by a full log ring") \
+    X(lock_wait_ns, "time spent waiting for outbound queue locks, ns")
+
+// Stats struct, one per thread so counting never shares a cache line;
+// readers add them all up
+typedef struct {
+#define X(name, help) atomic_ulong name;
+    STATS_COUNTERS(X)
+#undef X
+    hist_t queue_depth;         // Outbound queue length at each enqueue
+    hist_t fanout_ns;           // Time to queue one message for all its recipients
+    hist_t parse_ns;            // Time from reading a line to formatting its message
+    hist_t deliver_ns;          // Time from reading a line to the last write of its message
+} stats_t;
+
+// Log levels, records above log_level are not even formatted
+enum log_level {
+    LOG_ERROR,                  // Something failed
+    LOG_WARN,                   // A client was refused or cut off
+    LOG_INFO,                   // Connections and server events
+    LOG_DEBUG,                  // Details
+    LOG_TRACE                   // Sampled message trace, goes to the trace file
+};
+
+// Log record, formatted by the thread logging it and written out by the log writer
+typedef struct {
+    struct timespec ts;         // Wall clock time
+    int level;                  // enum log_level
+    int len;                    // Bytes of text
+    char text[LOG_TEXT_SZ];     // Message, no newline
+} log_rec_t;
+
+// Log ring of one thread: a single producer and the log writer, so neither
+// side locks; a full ring drops the new record rather than wait
+typedef struct log_ring {
+    _Alignas(64) atomic_ulong head; // Records ever written, producer side
+    _Alignas(64) atomic_ulong tail; // Records ever written out, writer side
+    char name[16];              // Thread name shown in each line
+    struct log_ring *next;      // Next registered ring
+    log_rec_t recs[LOG_RING];   // Records, head and tail modulo LOG_RING
+} log_ring_t;
+
+// io_uring instance set up with raw syscalls, only touched by its own thread
+typedef struct {
+    int fd;                     // Ring descriptor
+    unsigned *sq_head;          // Submission queue, mapped from the kernel
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_entries;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned tail;              // Submission tail including entries not yet handed to the kernel
+    unsigned *cq_head;          // Completion queue, mapped from the kernel
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+} uring_t;
+
+// What a completion is for, kept in the low bits of its user_data
+enum uring_tag {
+    URING_RECV,                 // recv into a client's input buffer
+    URING_SEND,                 // writev of a client's outbound queue
+    URING_WAKE,                 // read of the worker's eventfd
+    URING_ACCEPT,               // multishot accept
+    URING_CANCEL,               // cancellation of everything on a ring
+    URING_TAGS = 8              // client_t is 8 byte aligned
+};
+
+// Reactor struct, one per worker thread. Each worker is a shard: it owns a
+// subset of the rooms and every connection currently in one of them
+typedef struct reactor {
+    pthread_t tid;              // Worker thread
+    int epfd;                   // epoll instance owning this worker's connections
+    uring_t *ring;              // io_uring instance used instead of epfd, NULL on the epoll backend
+    uint64_t wake_val;          // Target of the ring's eventfd read
+    int ring_ops;               // Requests in flight on ring
+    int wakefd;                 // eventfd signalled when the inbox goes from idle to busy
+    atomic_int wake_pending;    // wakefd already signalled and not yet drained
+    _Atomic(task_t *) inbox_tail;   // Multi-producer end of the inbox (Vyukov MPSC queue)
+    task_t *inbox_head;         // Consumer end of the inbox, owner thread only
+    task_t inbox_stub;          // Inbox sentinel
+    client_t **local;           // Connections owned by this worker
+    int nlocal;                 // Number of owned connections
+    int local_cap;              // Allocated entries in local[]
+    client_t **throttled;       // Connections paused by flood control
+    int nthrottled;             // Number of paused connections
+    int throttled_cap;          // Allocated entries in throttled[]
+    wheel_t wheel;              // Liveness and write stall deadlines of owned connections
+    room_t **rooms;             // Rooms owned by this worker, hash buckets, power of two
+    unsigned int room_buckets;  // Number of room hash buckets
+    unsigned int nrooms;        // Number of rooms in the table
+    char *notice;               // Join/leave notices batched for one broadcast
+    size_t notice_len;          // Bytes used in notice
+    size_t notice_cap;          // Bytes allocated for notice
+    char *capture;              // Capture records not written yet, CAPTURE_BUF bytes
+    size_t capture_len;         // Bytes used in capture
+    unsigned long capture_ns;   // When capture was last written out
+    _Alignas(64) stats_t stats; // Counters of this worker
+} reactor_t;
+
+// Acceptor struct, one per listening socket
+typedef struct {
+    pthread_t tid;              // Acceptor thread
+    int listenfd;               // Non-blocking listening socket
+    uring_t *ring;              // Ring running the multishot accept, NULL when polling
+} acceptor_t;
+
+// First message of a hot restart, the listening sockets ride along
+typedef struct {
+    uint32_t magic;             // HANDOFF_MAGIC
+    int nlisten;                // Listening sockets passed
+    int next_uid;               // Next user id to hand out
+} handoff_hdr_t;
+
+// One client on a hot restart, followed by its unhandled input and unsent
+// output; its socket rides along. A record with uid 0 ends the handover
+typedef struct {
+    int uid;                    // Client unique identifier
+    int oper;                   // Logged in with /oper
+    int fresh;                  // Accepted but not announced yet
+    int binary;                 // Speaks binary frames
+    uint32_t inlen;             // Bytes of input that follow
+    uint32_t outlen;            // Bytes of output that follow the input
+    char name[32];              // Client name
+    char room[ROOM_NAME_SZ];    // Client room
+    struct sockaddr_in addr;    // Client remote address
+} handoff_t;
+
+// Server-to-server link. Peers exchange their users and relay room lines,
+// notices and whispers as "WORD args\n" headers, text as a length and raw bytes:
+//   NODE <id> [secret]         first line each way, with the shared secret when there is
+//                              one; the dialling side goes first, so the secret only
+//                              goes to a peer that showed it knows it already
+//   USER <uid> <room> <name>   a user of the sender joined or changed
+//   QUIT <uid>                 a user of the sender left
+//   ROOM <room> <len>          line for the members of a room
+//   ALL <len>                  line for everyone
+//   PRIV <uid> <len>           line for one user
+typedef struct {
+    int fd;                     // Socket, -1 while down
+    int node;                   // Peer node once it introduced itself, 0 before; relay_lock
+    int connecting;             // Outgoing connect() in progress
+    const char *peer;           // host:port dialled, NULL for an accepted link
+    unsigned long retry_ns;     // When to dial again
+    pthread_mutex_t lock;       // Guards out
+    char *out;                  // Bytes queued for the peer
+    size_t out_len;             // Bytes used in out
+    size_t out_cap;             // Bytes allocated for out
+    int broken;                 // out overflowed, the relay thread drops the link
+    char *in;                   // Bytes received and not handled yet, relay thread only
+    size_t in_len;              // Bytes used in in
+    size_t in_cap;              // Bytes allocated for in
+} link_t;
+
+// User of another server, known from its USER lines
+typedef struct remote {
+    int uid;                    // User id, unique across the federation
+    int link;                   // Index of the link it came over
+    char name[32];              // Name
+    char room[ROOM_NAME_SZ];    // Room
+    struct remote *next;        // Chain in the remote user table
+} remote_t;
+
+// Room with members on other servers, per link, so a line only goes to peers
+// that have someone to deliver it to
+typedef struct remote_room {
+    char name[ROOM_NAME_SZ];    // Room name
+    unsigned int hash;          // Hash of name
+    int members[MAX_LINKS];     // Members behind each link
+    int total;                  // All of them, the room is freed at 0
+    struct remote_room *next;   // Chain in the remote room table
+} remote_room_t;
+
+client_t **clients;                                         //all connected clients, grows on demand
+static unsigned int clients_cap;                            //allocated entries in clients[]
+static client_t **uid_index;                                //uid hash buckets, power of two
+static unsigned int uid_buckets;                            //number of uid hash buckets
+pthread_rwlock_t clients_lock = PTHREAD_RWLOCK_INITIALIZER; //guards the registry above plus names and room ids,
+                                                            //never taken on the room fan-out path
+static atomic_ulong roster_gen;                             //bumped under clients_lock on every registry change
+static roster_t *roster;                                    //latest /list snapshot, NULL until the first /list
+static pthread_mutex_t roster_mutex = PTHREAD_MUTEX_INITIALIZER;    //guards the roster pointer only
+static link_t links[MAX_LINKS];                             //server-to-server links, dialled ones first
+static int nlinks;                                          //link slots in use, 0 when not federated
+static remote_t **remotes;                                  //users of other servers by uid
+static unsigned int remote_count;                           //number of remote users
+static remote_room_t **remote_rooms;                        //rooms with members on other servers
+pthread_rwlock_t relay_lock = PTHREAD_RWLOCK_INITIALIZER;   //guards the links' node, remotes and remote_rooms;
+                                                            //taken after clients_lock when both are
+static int relay_wakefd = -1;                               //eventfd, a link has output queued
+static pthread_rwlock_t freeze_lock = PTHREAD_RWLOCK_WRITER_NONRECURSIVE_INITIALIZER_NP;
+                                                            //read held by workers, acceptors and the relay while
+                                                            //they handle a wakeup, written to stop them all for a hot restart
+
+static client_t *slabs[MAX_SLABS];                          //client_t pool, slabs are never freed
+static int nslabs;                                          //slabs allocated
+static client_t *free_clients;                              //free list threaded through the slabs
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static reactor_t *reactors;             //worker threads
+static int nreactors;                   //number of worker threads
+static acceptor_t *acceptors;           //acceptor threads, one per listening socket
+static int nacceptors = 1;              //number of acceptor threads
+static __thread reactor_t *current_reactor;    //worker running on this thread, NULL elsewhere
+static stats_t shared_stats;            //counters of the acceptor and other non-worker threads
+static __thread stats_t *my_stats = &shared_stats;  //counters this thread adds to
+
+#define STAT_ADD(field, n) atomic_fetch_add_explicit(&my_stats->field, (n), memory_order_relaxed)
+
+//Monotonic clock in nanoseconds
+static unsigned long now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+static int log_level = LOG_INFO;        //most verbose level logged
+static _Atomic(log_ring_t *) log_rings; //every thread's ring, added on its first record, never freed
+static atomic_int log_waiting;          //log writer asleep on log_wakefd
+static int log_wakefd = -1;             //eventfd waking the log writer
+static pthread_mutex_t log_drain_mutex = PTHREAD_MUTEX_INITIALIZER;     //one log_flush() at a time
+static __thread log_ring_t *my_log;     //ring of this thread, NULL until it logs
+static __thread char my_log_name[16] = "main";  //thread name for its ring
+static __thread unsigned long my_line_ns;       //when the line being handled was read, 0 outside a line
+static __thread int my_line_uid;        //client who sent it
+static __thread unsigned long my_lock_ns;       //queue lock waits of the fan-out running on this thread
+
+#define LOG(level, ...) do { if ((level) <= log_level) log_write((level), __VA_ARGS__); } while (0)
+#define LOG_ERRNO(what) LOG(LOG_ERROR, "%s: %s", (what), strerror(errno))
+
+//Name this thread in the log; a thread that already logged keeps its name
+static void log_thread(const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(my_log_name, sizeof(my_log_name), fmt, ap);
+    va_end(ap);
+}
+
+//Give this thread its ring, NULL when out of memory
+static log_ring_t *log_ring_new(void)
+{
+    log_ring_t *ring = (log_ring_t *)aligned_alloc(64, sizeof(log_ring_t));
+    if (!ring)
+    {
+        return NULL;
+    }
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    memcpy(ring->name, my_log_name, sizeof(ring->name));
+    ring->next = atomic_load(&log_rings);
+    while (!atomic_compare_exchange_weak(&log_rings, &ring->next, ring));
+    my_log = ring;
+    return ring;
+}
+
+//Format a record into this thread's ring; never blocks, the log writer
+//does the I/O
+static void log_write(int level, const char *fmt, ...)
+{
+    log_ring_t *ring = my_log ? my_log : log_ring_new();
+    va_list ap;
+
+    if (!ring)
+    {
+        return;
+    }
+    unsigned long head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    if (head - atomic_load_explicit(&ring->tail, memory_order_acquire) == LOG_RING)
+    {
+        STAT_ADD(log_dropped, 1);
+        return;
+    }
+    log_rec_t *rec = &ring->recs[head & (LOG_RING - 1)];
+    clock_gettime(CLOCK_REALTIME, &rec->ts);
+    rec->level = level;
+    va_start(ap, fmt);
+    int len = vsnprintf(rec->text, sizeof(rec->text), fmt, ap);
+    va_end(ap);
+    rec->len = len < 0 ? 0 : len < (int)sizeof(rec->text) ? len : (int)sizeof(rec->text) - 1;
+    atomic_store(&ring->head, head + 1);    //ordered before the check below, see log_loop()
+
+    if (atomic_load(&log_waiting) && atomic_exchange(&log_waiting, 0))
+    {
+        uint64_t one = 1;
+        if (write(log_wakefd, &one, sizeof(one)) < 0)
+        {
+            //eventfd only fails on overflow, the writer is awake then anyway
+        }
+    }
+}
+
+//Append one record as a line to a writer buffer, writing the buffer out when full
+static void log_emit(int fd, char *out, size_t *len, const char *name, const log_rec_t *rec)
+{
+    static const char *names[] = {"ERROR", "WARN", "INFO", "DEBUG", "TRACE"};
+    struct tm tm;
+
+    if (*len + LOG_TEXT_SZ + 64 > LOG_OUT_SZ)
+    {
+        if (write(fd, out, *len) < 0)
+        {
+            //nowhere left to report it
+        }
+        *len = 0;
+    }
+    localtime_r(&rec->ts.tv_sec, &tm);
+    *len += strftime(out + *len, 32, "%Y-%m-%d %H:%M:%S", &tm);
+    *len += snprintf(out + *len, LOG_OUT_SZ - *len, ".%06ld %-5s [%s] %.*s\n", rec->ts.tv_nsec / 1000,
+                     names[rec->level], name, rec->len, rec->text);
+}
+
+//Write out every record logged so far, oldest first across all threads;
+//errors and warnings go to stderr, traces to the trace file, the rest to stdout
+static void log_flush(void)
+{
+    static char out[3][LOG_OUT_SZ];
+    size_t len[3] = {0, 0, 0};
+    int fds[3] = {STDOUT_FILENO, STDERR_FILENO, trace_fd};
+
+    pthread_mutex_lock(&log_drain_mutex);
+    while (1)
+    {
+        log_ring_t *oldest = NULL;
+        log_rec_t *rec = NULL;
+        for (log_ring_t *ring = atomic_load(&log_rings); ring; ring = ring->next)
+        {
+            unsigned long tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+            if (tail == atomic_load_explicit(&ring->head, memory_order_acquire))
+            {
+                continue;
+            }
+            log_rec_t *r = &ring->recs[tail & (LOG_RING - 1)];
+            if (!rec || r->ts.tv_sec < rec->ts.tv_sec ||
+                (r->ts.tv_sec == rec->ts.tv_sec && r->ts.tv_nsec < rec->ts.tv_nsec))
+            {
+                oldest = ring;
+                rec = r;
+            }
+        }
+        if (!oldest)
+        {
+            break;
+        }
+        int o = rec->level == LOG_TRACE ? 2 : rec->level <= LOG_WARN;
+        log_emit(fds[o], out[o], &len[o], oldest->name, rec);
+        atomic_fetch_add_explicit(&oldest->tail, 1, memory_order_release);
+    }
+    for (int i = 0; i < 3; i++)
+    {
+        if (len[i] && write(fds[i], out[i], len[i]) < 0)
+        {
+            //nowhere left to report it
+        }
+    }
+    pthread_mutex_unlock(&log_drain_mutex);
+}
+
+//Log writer: sleeps until a record arrives, lets more gather for
+//LOG_BATCH_MS and writes them all out, so logging threads never do I/O
+static void *log_loop(void *arg)
+{
+    (void)arg;
+    while (1)
+    {
+        uint64_t n;
+        atomic_store(&log_waiting, 1);
+        //a record logged before the flag was set is seen here, one after it wakes us
+        int pending = 0;
+        for (log_ring_t *ring = atomic_load(&log_rings); ring; ring = ring->next)
+        {
+            pending |= atomic_load(&ring->head) != atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        }
+        if (!pending && read(log_wakefd, &n, sizeof(n)) < 0 && errno != EINTR)
+        {
+            return NULL;
+        }
+        atomic_store(&log_waiting, 0);
+        struct timespec batch = {0, LOG_BATCH_MS * 1000000L};
+        nanosleep(&batch, NULL);
+        log_flush();
+    }
+    return NULL;
+}
+
+//Start the log writer, records are written out at exit too
+static int log_start(void)
+{
+    pthread_t tid;
+
+    log_wakefd = eventfd(0, EFD_CLOEXEC);
+    if (log_wakefd < 0)
+    {
+        perror("Log eventfd failed");
+        return -1;
+    }
+    if (pthread_create(&tid, NULL, log_loop, NULL) != 0)
+    {
+        fprintf(stderr, "Log writer start failed\n");
+        return -1;
+    }
+    pthread_detach(tid);
+    atexit(log_flush);
+    return 0;
+}
+static int spare_fd = -1;               //reserved descriptor, released to shed connections on EMFILE
+
+//Parse a flood limit given as rate[:burst], the burst defaults to one second's worth
+static void parse_limit(const char *s, limit_t *l)
+{
+    char *end;
+    l->rate = strtod(s, &end);
+    l->burst = *end == ':' ? strtod(end + 1, NULL) : l->rate;
+    if (l->rate < 0)
+    {
+        l->rate = 0;
+    }
+    if (l->burst < 1)
+    {
+        l->burst = 1;
+    }
+}
+
+//Fill a bucket up for the time gone by, returns ns until it holds a whole
+//token, 0 when it does or there is no limit
+static unsigned long bucket_wait(bucket_t *b, const limit_t *l, unsigned long now)
+{
+    if (l->rate <= 0)
+    {
+        return 0;
+    }
+    b->tokens += (now - b->last_ns) * l->rate / 1e9;
+    if (b->tokens > l->burst)
+    {
+        b->tokens = l->burst;
+    }
+    b->last_ns = now;
+    return b->tokens >= 1 ? 0 : (unsigned long)((1 - b->tokens) / l->rate * 1e9) + 1;
+}
+
+//Start a bucket full
+static void bucket_init(bucket_t *b, const limit_t *l)
+{
+    b->tokens = l->burst;
+    b->last_ns = now_ns();
+}
+
+//Schedule a timer for tick expires, or the next tick run when that is past
+static void wheel_add(wheel_t *w, wtimer_t *t, unsigned long expires)
+{
+    unsigned long span = 1UL << (WHEEL_BITS * WHEEL_LEVELS);
+    int level = 0;
+
+    if ((long)(expires - w->tick) < 0)
+    {
+        expires = w->tick;
+    }
+    if (expires - w->tick >= span)
+    {
+        expires = w->tick + span - 1;   //fires early, the owner schedules the rest
+    }
+    while (level < WHEEL_LEVELS - 1 && expires - w->tick >= 1UL << (WHEEL_BITS * (level + 1)))
+    {
+        level++;
+    }
+    wtimer_t **slot = &w->slot[level][(expires >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1)];
+    t->expires = expires;
+    t->next = *slot;
+    if (t->next)
+    {
+        t->next->pprev = &t->next;
+    }
+    t->pprev = slot;
+    *slot = t;
+    w->count++;
+}
+
+//Unschedule a timer, no-op when it is not scheduled
+static void wheel_del(wheel_t *w, wtimer_t *t)
+{
+    if (!t->pprev)
+    {
+        return;
+    }
+    *t->pprev = t->next;
+    if (t->next)
+    {
+        t->next->pprev = t->pprev;
+    }
+    t->pprev = NULL;
+    w->count--;
+}
+
+//Take a whole slot out of the wheel; its first entry links back to list, so
+//entries can still be deleted while the caller walks it
+static wtimer_t *wheel_take(wheel_t *w, wtimer_t **slot, wtimer_t **list)
+{
+    *list = *slot;
+    *slot = NULL;
+    if (*list)
+    {
+        (*list)->pprev = list;
+    }
+    return *list;
+}
+
+//function prototyping
+int queue_add(client_t *cl);
+void queue_delete(int uid);
+unsigned int name_hash(const char *s);
+void room_join(client_t *cl, int replay);
+void room_leave(client_t *cl);
+client_t *client_alloc(int connfd, struct sockaddr_in *addr);
+void client_free(client_t *cl);
+client_t *client_find(int uid);
+int listen_socket(in_addr_t addr, int port, int backlog, int reuseport);
+void *acceptor_loop(void *arg);
+void *metrics_loop(void *arg);
+size_t stats_format(char *buf, size_t cap, const char *eol);
+void reactor_post(reactor_t *r, task_t *t);
+reactor_t *room_reactor(const char *name);
+int client_move(client_t *cl);
+void client_handoff(client_t *cl);
+msg_t *msg_new(const char *s, size_t len);
+msg_t *msg_printf(const char *fmt, ...);
+void msg_unref(msg_t *m);
+void message(msg_t *m, int uid, room_t *room);
+void message_all(msg_t *m);
+void message_local(msg_t *m);
+void message_self(const char *s, client_t *cl);
+void message_client(msg_t *m, int uid);
+roster_t *roster_get(void);
+void roster_put(roster_t *ro);
+void client_send(client_t *cl, msg_t *m);
+void client_flush(client_t *cl);
+size_t outq_advance(client_t *cl, size_t n);
+void *reactor_loop(void *arg);
+void client_join(client_t *cl);
+void client_read(client_t *cl);
+int client_lines(client_t *cl);
+void client_resume(client_t *cl);
+void client_close(client_t *cl);
+int handle_line(client_t *my_client, char *line);
+void commands_init(void);
+int uring_probe(void);
+int uring_init(uring_t *u, unsigned entries);
+int uring_accept_loop(acceptor_t *a);
+void uring_loop(reactor_t *r);
+void uring_recv(reactor_t *r, client_t *cl);
+void uring_send(reactor_t *r, client_t *cl);
+int takeover_begin(const char *path, int *listenfds, int *nlisten);
+int takeover_clients(int ctl);
+int upgrade_listen(const char *path);
+void *upgrade_loop(void *arg);
+void relay_user(client_t *cl);
+void relay_quit(int uid);
+void relay_room(const char *room, msg_t *m);
+void relay_all(msg_t *m);
+int relay_priv(int uid, msg_t *m);
+int relay_init(void);
+void *relay_loop(void *arg);
+int capture_open(const char *path);
+
+
+int main(int argc, char *argv[])
+{
+    int port = 6667;
+    int backlog = BACKLOG_DEFAULT;
+    int metrics_port = 0;
+    int opt;
+
+    //command line options
+    nreactors = sysconf(_SC_NPROCESSORS_ONLN);
+    while ((opt = getopt(argc, argv, "a:b:c:C:f:F:k:K:l:L:m:n:o:p:P:q:R:s:t:T:uU:v:x:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'p':   //listening port
+            port = atoi(optarg);
+            break;
+        case 't':   //number of worker threads, one shard of the rooms each
+            nreactors = atoi(optarg);
+            break;
+        case 'a':   //number of SO_REUSEPORT acceptors
+            nacceptors = atoi(optarg);
+            break;
+        case 'b':   //listen backlog
+            backlog = atoi(optarg);
+            break;
+        case 'c':   //maximum number of clients
+            max_clients = atoi(optarg);
+            break;
+        case 'm':   //local port serving a stats dump
+            metrics_port = atoi(optarg);
+            break;
+        case 'f':   //lines per second per client, rate[:burst]
+            parse_limit(optarg, &client_limit);
+            break;
+        case 'F':   //chat lines per second per room, rate[:burst]
+            parse_limit(optarg, &room_limit);
+            break;
+        case 'x':   //flood control policy
+            if (!strcmp(optarg, "delay"))
+            {
+                flood = FLOOD_DELAY;
+            }
+            else if (!strcmp(optarg, "drop"))
+            {
+                flood = FLOOD_DROP;
+            }
+            else if (!strcmp(optarg, "disconnect"))
+            {
+                flood = FLOOD_DISCONNECT;
+            }
+            else
+            {
+                fprintf(stderr, "flood policy must be delay, drop or disconnect\n");
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'k':   //seconds idle before a PING, then to answer it
+        {
+            char *end;
+            ping_ns = strtod(optarg, &end) * 1e9;
+            if (*end == ':')
+            {
+                pong_ns = strtod(end + 1, NULL) * 1e9;
+            }
+            break;
+        }
+        case 's':   //seconds output may make no progress
+            stall_ns = strtod(optarg, NULL) * 1e9;
+            break;
+        case 'n':   //node id in a federation
+            node_id = atoi(optarg);
+            break;
+        case 'L':   //port other servers link to, [address:]port
+        {
+            char *colon = strrchr(optarg, ':');
+            struct in_addr a;
+            if (colon)
+            {
+                *colon = '\0';
+                if (inet_pton(AF_INET, optarg, &a) != 1)
+                {
+                    fprintf(stderr, "bad link address %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                link_addr = ntohl(a.s_addr);
+            }
+            link_port = atoi(colon ? colon + 1 : optarg);
+            break;
+        }
+        case 'K':   //secret every server of the federation shares
+            link_secret = optarg;
+            break;
+        case 'C':   //server to link to, host:port
+            if (nlink_peers < MAX_LINKS)
+            {
+                link_peers[nlink_peers++] = optarg;
+            }
+            break;
+        case 'u':   //io_uring backend
+            use_uring = 1;
+            break;
+        case 'U':   //control socket for hot restarts
+            upgrade_path = optarg;
+            break;
+        case 'l':   //directory keeping room scrollback across restarts
+            log_dir = optarg;
+            break;
+        case 'T':   //sampled trace file, path[:one message in how many]
+        {
+            char *every = strrchr(optarg, ':');
+            if (every)
+            {
+                *every++ = '\0';
+                trace_every = strtoul(every, NULL, 10);
+            }
+            if (trace_every < 1)
+            {
+                trace_every = 1;
+            }
+            trace_fd = open(optarg, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+            if (trace_fd < 0)
+            {
+                perror("Cannot open trace file");
+                return EXIT_FAILURE;
+            }
+            break;
+        }
+        case 'R':   //record inbound traffic for replay with loadgen
+            if (capture_open(optarg) < 0)
+            {
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'v':   //log level
+        {
+            static const char *levels[] = {"error", "warn", "info", "debug"};
+            log_level = -1;
+            for (int i = 0; i < 4; i++)
+            {
+                if (!strcmp(optarg, levels[i]))
+                {
+                    log_level = i;
+                }
+            }
+            if (log_level < 0)
+            {
+                fprintf(stderr, "log level must be error, warn, info or debug\n");
+                return EXIT_FAILURE;
+            }
+            break;
+        }
+        case 'P':   //operator password
+            oper_password = optarg;
+            break;
+        case 'q':   //outbound queue length per client
+            outq_limit = atoi(optarg);
+            break;
+        case 'o':   //outbound queue overflow policy
+            if (!strcmp(optarg, "drop"))
+            {
+                overflow = OVERFLOW_DROP;
+            }
+            else if (!strcmp(optarg, "disconnect"))
+            {
+                overflow = OVERFLOW_DISCONNECT;
+            }
+            else
+            {
+                fprintf(stderr, "overflow policy must be drop or disconnect\n");
+                return EXIT_FAILURE;
+            }
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-p port] [-t threads] [-a acceptors] [-b backlog] [-c max clients] [-q queue length] [-o drop|disconnect] [-m metrics port] [-P oper password] [-l log dir] [-f client lines/s[:burst]] [-F room lines/s[:burst]] [-x delay|drop|disconnect] [-k ping s[:timeout s]] [-s stall s] [-u] [-U upgrade socket] [-n node] [-L [address:]link port] [-K link secret] [-C host:port]... [-v error|warn|info|debug] [-T trace file[:every]] [-R capture file]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (nreactors < 1)
+    {
+        nreactors = 1;
+    }
+    if ((link_port || nlink_peers) && (node_id < 1 || node_id > MAX_NODE))
+    {
+        fprintf(stderr, "linking needs a node id from 1 to %d\n", MAX_NODE);
+        return EXIT_FAILURE;
+    }
+    if (link_port && link_addr != INADDR_LOOPBACK && !link_secret)
+    {
+        //a peer can speak for any user, so a reachable link port needs a password
+        fprintf(stderr, "a link port beyond loopback needs a shared secret (-K)\n");
+        return EXIT_FAILURE;
+    }
+    if (link_secret && (strpbrk(link_secret, " \t\r\n") || strlen(link_secret) >= LINK_SECRET_SZ))
+    {
+        fprintf(stderr, "the link secret must be one word of at most %d characters\n", LINK_SECRET_SZ - 1);
+        return EXIT_FAILURE;
+    }
+    atomic_store(&uid, node_id * UID_SPAN + 100);   //each node hands out its own ids
+    if (nacceptors < 1)
+    {
+        nacceptors = 1;
+    }
+    if (nacceptors > MAX_ACCEPTORS)
+    {
+        nacceptors = MAX_ACCEPTORS;
+    }
+    if (outq_limit < 2)
+    {
+        outq_limit = 2;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    if (log_start() < 0)
+    {
+        return EXIT_FAILURE;
+    }
+    commands_init();
+    spare_fd = open("/dev/null", O_RDONLY);
+
+    //every client is a descriptor, allow as many as the hard limit does
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0)
+    {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    //take the listening sockets over from a running server, or set them up;
+    //several acceptors share the port with SO_REUSEPORT
+    int listenfds[MAX_ACCEPTORS];
+    int takeover = upgrade_path ? takeover_begin(upgrade_path, listenfds, &nacceptors) : -1;
+    acceptors = calloc(nacceptors, sizeof(acceptor_t));
+    for (int i = 0; i < nacceptors; i++)
+    {
+        acceptors[i].listenfd = takeover >= 0 ? listenfds[i] : listen_socket(INADDR_ANY, port, backlog, nacceptors > 1);
+        if (acceptors[i].listenfd < 0)
+        {
+            return EXIT_FAILURE;
+        }
+    }
+
+    //decide on the backend once, so the workers either all run io_uring or none does
+    if (use_uring && !uring_probe())
+    {
+        LOG(LOG_WARN, "io_uring unavailable, using epoll");
+        use_uring = 0;
+    }
+
+    //start the worker threads, each with its own epoll instance
+    reactors = calloc(nreactors, sizeof(reactor_t));
+    for (int i = 0; i < nreactors; i++)
+    {
+        reactor_t *r = &reactors[i];
+        r->epfd = epoll_create1(0);
+        r->wakefd = eventfd(0, EFD_NONBLOCK);
+        if (r->epfd < 0 || r->wakefd < 0)
+        {
+            LOG_ERRNO("epoll_create1 failed");
+            return EXIT_FAILURE;
+        }
+        if (use_uring)
+        {
+            r->ring = (uring_t *)malloc(sizeof(uring_t));
+            if (!r->ring || uring_init(r->ring, URING_ENTRIES) < 0)
+            {
+                LOG_ERRNO("io_uring setup failed");
+                return EXIT_FAILURE;
+            }
+        }
+        r->wheel.tick = now_ns() / TICK_NS;
+        atomic_init(&r->inbox_stub.next, NULL);
+        atomic_init(&r->inbox_tail, &r->inbox_stub);
+        r->inbox_head = &r->inbox_stub;
+
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = NULL;     //NULL marks the wakeup descriptor
+        epoll_ctl(r->epfd, EPOLL_CTL_ADD, r->wakefd, &ev);
+        pthread_create(&r->tid, NULL, &reactor_loop, r);
+    }
+    if (takeover >= 0 && takeover_clients(takeover) < 0)
+    {
+        return EXIT_FAILURE;
+    }
+    LOG(LOG_INFO, "Server started on port %d", port);
+
+    //wait for the next version of the server
+    if (upgrade_path)
+    {
+        static int upgrade_fd;
+        pthread_t tid;
+        upgrade_fd = upgrade_listen(upgrade_path);
+        if (upgrade_fd < 0)
+        {
+            return EXIT_FAILURE;
+        }
+        pthread_create(&tid, NULL, &upgrade_loop, &upgrade_fd);
+    }
+
+    //stats dump for local monitoring, never reachable from outside
+    if (metrics_port)
+    {
+        static int metrics_fd;
+        pthread_t tid;
+        metrics_fd = listen_socket(INADDR_LOOPBACK, metrics_port, 16, 0);
+        for (int i = 0; metrics_fd < 0 && takeover >= 0 && i < 50; i++)
+        {
+            usleep(20000);      //the previous process may still be closing its own
+            metrics_fd = listen_socket(INADDR_LOOPBACK, metrics_port, 16, 0);
+        }
+        if (metrics_fd < 0)
+        {
+            return EXIT_FAILURE;
+        }
+        pthread_create(&tid, NULL, &metrics_loop, &metrics_fd);
+    }
+
+    //link to the other servers of the federation
+    if (link_port || nlink_peers)
+    {
+        static int link_fd = -1;
+        pthread_t tid;
+        if (link_port)
+        {
+            link_fd = listen_socket(link_addr, link_port, 16, 0);
+        }
+        if ((link_port && link_fd < 0) || relay_init() < 0)
+        {
+            return EXIT_FAILURE;
+        }
+        pthread_create(&tid, NULL, &relay_loop, &link_fd);
+    }
+
+    //accept and handle clients, the main thread runs the first acceptor
+    for (int i = 1; i < nacceptors; i++)
+    {
+        pthread_create(&acceptors[i].tid, NULL, &acceptor_loop, &acceptors[i]);
+    }
+    acceptor_loop(&acceptors[0]);
+
+    return EXIT_SUCCESS;
+}
+
+//Create a non-blocking listening socket on addr:port, addr in host order
+int listen_socket(in_addr_t addr, int port, int backlog, int reuseport)
+{
+    struct sockaddr_in serv_addr;
+    int on = 1;
+
+    //set up socket
+    int listenfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (listenfd < 0)
+    {
+        LOG_ERRNO("Socket creation failed");
+        return -1;
+    }
+    setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    if (reuseport && setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0)
+    {
+        LOG_ERRNO("SO_REUSEPORT failed");
+        close(listenfd);
+        return -1;
+    }
+    memset(&serv_addr, 0, sizeof(serv_addr));
+    serv_addr.sin_family = AF_INET;
+    serv_addr.sin_addr.s_addr = htonl(addr);
+    serv_addr.sin_port = htons(port);
+
+    //bind socket
+    if (bind(listenfd, (struct sockaddr*)&serv_addr, sizeof(serv_addr)) < 0) 
+    {
+        LOG_ERRNO("Socket binding failed");
+        close(listenfd);
+        return -1;
+    }
+
+    //listen
+    if (listen(listenfd, backlog) < 0) {
+        LOG_ERRNO("Socket listening failed");
+        close(listenfd);
+        return -1;
+    }
+    return listenfd;
+}
+
+//Out of descriptors: free the spare one to accept and drop a connection,
+//otherwise it stays in the backlog and the listener keeps firing
+static void accept_shed(int listenfd)
+{
+    close(spare_fd);
+    int connfd = accept(listenfd, NULL, NULL);
+    if (connfd >= 0)
+    {
+        STAT_ADD(accepted, 1);
+        STAT_ADD(rejected, 1);
+        close(connfd);
+    }
+    spare_fd = open("/dev/null", O_RDONLY);
+}
+
+//Hand a freshly accepted connection to the worker owning the default room,
+//which adds it to the queue and announces it
+static void accept_client(int connfd, struct sockaddr_in *addr)
+{
+    STAT_ADD(accepted, 1);
+
+    unsigned int count = 0;
+    if (max_clients)
+    {
+        pthread_rwlock_rdlock(&clients_lock);   //workers add and remove clients meanwhile
+        count = client_count;
+        pthread_rwlock_unlock(&clients_lock);
+    }
+    if (max_clients && count >= max_clients)    //don't go past max number of clients
+    {
+        LOG(LOG_WARN, "Max clients reached");
+        STAT_ADD(rejected, 1);
+        close(connfd);
+        return;
+    }
+
+    client_t *my_client = client_alloc(connfd, addr);
+    if (!my_client)
+    {
+        STAT_ADD(rejected, 1);
+        close(connfd);
+        return;
+    }
+    my_client ->handoff.kind = TASK_NEW;
+    reactor_post(room_reactor(my_client ->room), &my_client ->handoff);
+}
+
+//Acceptor thread: drain the listen queue in batches and hand connections to the workers
+void *acceptor_loop(void *arg)
+{
+    acceptor_t *a = (acceptor_t *)arg;
+    struct pollfd pfd = { .fd = a->listenfd, .events = POLLIN };
+    struct sockaddr_in cli_addr;
+
+    log_thread("a%d", (int)(a - acceptors));
+    if (use_uring && uring_accept_loop(a) < 0)
+    {
+        LOG(LOG_WARN, "Multishot accept unavailable, polling the listener");
+    }
+    while (1) 
+    {
+        if (poll(&pfd, 1, -1) < 0)
+        {
+            if (errno != EINTR)
+            {
+                LOG_ERRNO("poll failed");
+            }
+            continue;
+        }
+
+        pthread_rwlock_rdlock(&freeze_lock);
+        for (int i = 0; i < ACCEPT_BATCH; i++)
+        {
+            socklen_t clientlength = sizeof(cli_addr);
+            int connfd = accept4(a->listenfd, (struct sockaddr*)&cli_addr, &clientlength, SOCK_NONBLOCK);
+            if (connfd < 0)
+            {
+                if (errno == EMFILE || errno == ENFILE)
+                {
+                    LOG_ERRNO("Accept failed");
+                    accept_shed(a->listenfd);
+                    break;
+                }
+                if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && errno != ECONNABORTED)
+                {
+                    LOG_ERRNO("Accept failed");
+                }
+                break;          //listen queue drained
+            }
+            accept_client(connfd, &cli_addr);
+        }
+        pthread_rwlock_unlock(&freeze_lock);
+    }
+
+    return NULL;
+}
+
+//Metrics thread: answer every connection on the local port with a stats dump
+void *metrics_loop(void *arg)
+{
+    int listenfd = *(int *)arg;
+    struct pollfd pfd = { .fd = listenfd, .events = POLLIN };
+    char *buf = (char *)malloc(STATS_SZ);
+
+    log_thread("metrics");
+    while (buf)
+    {
+        if (poll(&pfd, 1, -1) < 0)
+        {
+            continue;
+        }
+        int connfd = accept(listenfd, NULL, NULL);
+        if (connfd < 0)
+        {
+            continue;
+        }
+        size_t len = stats_format(buf, STATS_SZ, "\n");
+        if (write(connfd, buf, len) < 0)
+        {
+            LOG_ERRNO("Metrics write failed");
+        }
+        close(connfd);
+    }
+    return NULL;
+}
+
+//Count a value in a log2 histogram
+static void hist_add(hist_t *h, unsigned long v)
+{
+    int b = v ? 64 - __builtin_clzl(v) : 0;
+    if (b >= HIST_BUCKETS)
+    {
+        b = HIST_BUCKETS - 1;
+    }
+    atomic_fetch_add_explicit(&h->count[b], 1, memory_order_relaxed);
+}
+
+//Append to a stats dump, output past cap is cut off
+static void stats_printf(char *buf, size_t cap, size_t *len, const char *fmt, ...)
+{
+    va_list ap;
+    if (*len >= cap - 1)
+    {
+        return;
+    }
+    va_start(ap, fmt);
+    int n = vsnprintf(buf + *len, cap - *len, fmt, ap);
+    va_end(ap);
+    *len = (n < 0 || *len + n >= cap) ? cap - 1 : *len + n;
+}
+
+//Add up one histogram over every thread's stats
+static void hist_sum(unsigned long *sum, size_t offset)
+{
+    for (int b = 0; b < HIST_BUCKETS; b++)
+    {
+        hist_t *h = (hist_t *)((char *)&shared_stats + offset);
+        sum[b] = atomic_load_explicit(&h->count[b], memory_order_relaxed);
+        for (int i = 0; i < nreactors; i++)
+        {
+            h = (hist_t *)((char *)&reactors[i].stats + offset);
+            sum[b] += atomic_load_explicit(&h->count[b], memory_order_relaxed);
+        }
+    }
+}
+
+//Dump a histogram as cumulative buckets plus quantiles, estimated by the largest
+//value of the bucket they fall in
+static void hist_format(char *buf, size_t cap, size_t *len, const char *name, size_t offset, const char *eol)
+{
+    const double q[] = { 0.5, 0.99, 0.999 };
+    unsigned long sum[HIST_BUCKETS], total = 0, seen = 0;
+    int top = 0;
+
+    hist_sum(sum, offset);
+    for (int b = 0; b < HIST_BUCKETS; b++)
+    {
+        total += sum[b];
+        if (sum[b])
+        {
+            top = b;
+        }
+    }
+    for (int b = 0; b <= top; b++)
+    {
+        seen += sum[b];
+        stats_printf(buf, cap, len, "irc_%s_bucket{le=\"%lu\"} %lu%s", name, (1UL << b) - 1, seen, eol);
+    }
+    for (int i = 0; i < 3; i++)
+    {
+        int b = 0;
+        for (seen = sum[0]; b < top && seen < q[i] * total; seen += sum[++b]);
+        stats_printf(buf, cap, len, "irc_%s{quantile=\"%g\"} %lu%s", name, q[i], total ? (1UL << b) - 1 : 0, eol);
+    }
+    stats_printf(buf, cap, len, "irc_%s_count %lu%s", name, total, eol);
+}
+
+//Format every counter summed over the threads, one "name value" per line
+size_t stats_format(char *buf, size_t cap, const char *eol)
+{
+    size_t len = 0;
+    unsigned long v;
+
+    pthread_rwlock_rdlock(&clients_lock);
+    stats_printf(buf, cap, &len, "# clients connected%sirc_clients %u%s", eol, client_count, eol);
+    pthread_rwlock_unlock(&clients_lock);
+#define X(name, help) \
+    v = atomic_load_explicit(&shared_stats.name, memory_order_relaxed); \
+    for (int i = 0; i < nreactors; i++) \
+    { \
+        v += atomic_load_explicit(&reactors[i].stats.name, memory_order_relaxed); \
+    } \
+    stats_printf(buf, cap, &len, "# %s%sirc_%s %lu%s", help, eol, #name, v, eol);
+    STATS_COUNTERS(X)
+#undef X
+    stats_printf(buf, cap, &len, "# outbound queue length at each enqueue%s", eol);
+    hist_format(buf, cap, &len, "queue_depth", offsetof(stats_t, queue_depth), eol);
+    stats_printf(buf, cap, &len, "# time to queue one message for all its recipients, ns%s", eol);
+    hist_format(buf, cap, &len, "fanout_ns", offsetof(stats_t, fanout_ns), eol);
+    stats_printf(buf, cap, &len, "# time from reading a line to formatting its message, ns%s", eol);
+    hist_format(buf, cap, &len, "parse_ns", offsetof(stats_t, parse_ns), eol);
+    stats_printf(buf, cap, &len, "# time from reading a line to the last write of its message, ns%s", eol);
+    hist_format(buf, cap, &len, "deliver_ns", offsetof(stats_t, deliver_ns), eol);
+    return len;
+}
+
+//Worker owning a room: rooms are spread over the workers by name and every
+//member of a room lives on that worker, so room fan-out never crosses threads
+reactor_t *room_reactor(const char *name)
+{
+    return &reactors[name_hash(name) % nreactors];
+}
+
+//Push a task on a worker's inbox from any thread, lock free
+//the eventfd is only written when the inbox goes from idle to busy
+void reactor_post(reactor_t *r, task_t *t)
+{
+    uint64_t one = 1;
+
+    atomic_store_explicit(&t->next, NULL, memory_order_relaxed);
+    task_t *prev = atomic_exchange(&r->inbox_tail, t);
+    atomic_store_explicit(&prev->next, t, memory_order_release);
+
+    if (!atomic_exchange(&r->wake_pending, 1) && write(r->wakefd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+    {
+        LOG_ERRNO("eventfd write failed");
+    }
+}
+
+//Pop the oldest task, owner thread only; NULL when the inbox is empty
+static task_t *reactor_pop(reactor_t *r)
+{
+    while (1)
+    {
+        task_t *head = r->inbox_head;
+        task_t *next = atomic_load_explicit(&head->next, memory_order_acquire);
+
+        if (head == &r->inbox_stub)     //skip the sentinel
+        {
+            if (!next)
+            {
+                if (head == atomic_load(&r->inbox_tail))
+                {
+                    return NULL;
+                }
+                sched_yield();      //a producer is between its two stores
+                continue;
+            }
+            r->inbox_head = next;
+            head = next;
+            next = atomic_load_explicit(&head->next, memory_order_acquire);
+        }
+        if (next)
+        {
+            r->inbox_head = next;
+            return head;
+        }
+        if (head == atomic_load(&r->inbox_tail))
+        {
+            //head is the last task, park the sentinel behind it so it can be taken
+            atomic_store_explicit(&r->inbox_stub.next, NULL, memory_order_relaxed);
+            task_t *prev = atomic_exchange(&r->inbox_tail, &r->inbox_stub);
+            atomic_store_explicit(&prev->next, &r->inbox_stub, memory_order_release);
+            next = atomic_load_explicit(&head->next, memory_order_acquire);
+            if (next)
+            {
+                r->inbox_head = next;
+                return head;
+            }
+        }
+        sched_yield();      //a producer is between its two stores, it finishes shortly
+    }
+}
+
+//Append a notice for every client; a connection storm then costs one
+//broadcast per worker wakeup instead of one per connection
+static void reactor_notice(reactor_t *r, const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    int len = vsnprintf(NULL, 0, fmt, ap);
+    va_end(ap);
+    if (len < 0)
+    {
+        return;
+    }
+    if (r->notice_len + len + 1 > r->notice_cap)
+    {
+        size_t cap = (r->notice_len + len + 1) * 2;
+        char *notice = (char *)realloc(r->notice, cap);
+        if (!notice)
+        {
+            LOG_ERRNO("Cannot allocate memory");
+            return;
+        }
+        r->notice = notice;
+        r->notice_cap = cap;
+    }
+    va_start(ap, fmt);
+    vsnprintf(r->notice + r->notice_len, len + 1, fmt, ap);
+    va_end(ap);
+    r->notice_len += len;
+}
+
+//Broadcast the batched notices
+static void reactor_flush_notices(reactor_t *r)
+{
+    if (r->notice_len > 0)
+    {
+        message_all(msg_new(r->notice, r->notice_len));
+        r->notice_len = 0;
+    }
+}
+
+//Open the capture file, or append to it, as after a hot restart; the start
+//time in its header keeps the record times of every process on one clock
+int capture_open(const char *path)
+{
+    char head[sizeof(CAPTURE_MAGIC) - 1 + sizeof(uint64_t)];
+    struct timespec ts;
+    uint64_t start;
+
+    capture_fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (capture_fd < 0)
+    {
+        perror("Cannot open capture file");
+        return -1;
+    }
+    clock_gettime(CLOCK_REALTIME, &ts);
+    uint64_t now = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    ssize_t n = pread(capture_fd, head, sizeof(head), 0);
+    if (n == 0)
+    {
+        start = now;
+        memcpy(head, CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC) - 1);
+        memcpy(head + sizeof(CAPTURE_MAGIC) - 1, &start, sizeof(start));
+        n = write(capture_fd, head, sizeof(head));
+    }
+    else if (n == (ssize_t)sizeof(head) && !memcmp(head, CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC) - 1))
+    {
+        memcpy(&start, head + sizeof(CAPTURE_MAGIC) - 1, sizeof(start));
+    }
+    else
+    {
+        fprintf(stderr, "%s is not a capture file\n", path);
+        return -1;
+    }
+    if (n != (ssize_t)sizeof(head))
+    {
+        perror("Cannot write capture file");
+        return -1;
+    }
+    capture_t0 = now_ns() - (now - start);
+    return 0;
+}
+
+//Write out the worker's captured input, or only once it is CAPTURE_FLUSH_NS
+//old unless force; one append per batch keeps the workers' records whole
+static void capture_flush(reactor_t *r, int force)
+{
+    unsigned long now = now_ns();
+    if (!r->capture_len || (!force && now - r->capture_ns < CAPTURE_FLUSH_NS))
+    {
+        return;
+    }
+    if (write(capture_fd, r->capture, r->capture_len) < 0)
+    {
+        LOG_ERRNO("Capture write failed");
+    }
+    r->capture_len = 0;
+    r->capture_ns = now;
+}
+
+//Record a connection event or its input for replay, on its owning worker
+static void capture(reactor_t *r, int uid, int kind, const char *data, size_t len)
+{
+    capture_rec_t rec;
+
+    if (capture_fd < 0 || !r)
+    {
+        return;
+    }
+    if (!r->capture && !(r->capture = (char *)malloc(CAPTURE_BUF)))
+    {
+        return;
+    }
+    if (r->capture_len + sizeof(rec) + len > CAPTURE_BUF)
+    {
+        capture_flush(r, 1);
+    }
+    rec.ns = now_ns() - capture_t0;
+    rec.uid = uid;
+    rec.kind = kind;
+    rec.len = len;
+    memcpy(r->capture + r->capture_len, &rec, sizeof(rec));
+    memcpy(r->capture + r->capture_len + sizeof(rec), data, len);
+    r->capture_len += sizeof(rec) + len;
+}
+
+//Make a connection local to this worker: list it, put it in its room and watch
+//it; replay is 0 for one that was in the room already, as across a hot restart
+static int reactor_attach(reactor_t *r, client_t *cl, int replay)
+{
+    pthread_mutex_lock(&cl->out_lock);     //flushes from other threads follow the owner
+    cl->reactor = r;
+    pthread_mutex_unlock(&cl->out_lock);
+    if (r->nlocal == r->local_cap)
+    {
+        int cap = r->local_cap ? r->local_cap * 2 : 1024;
+        client_t **local = (client_t **)realloc(r->local, cap * sizeof(client_t *));
+        if (!local)
+        {
+            LOG_ERRNO("Cannot allocate memory");
+            return -1;
+        }
+        r->local = local;
+        r->local_cap = cap;
+    }
+    cl->local_slot = r->nlocal;
+    r->local[r->nlocal++] = cl;
+    room_join(cl, replay);
+    if (ping_ns || stall_ns)
+    {
+        wheel_add(&r->wheel, &cl->timer, r->wheel.tick);    //the first check sets the real deadline
+    }
+    if (r->ring)
+    {
+        return 0;               //the caller arms a recv once it is done with the input buffer
+    }
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = cl;
+    if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, cl->connfd, &ev) < 0)
+    {
+        LOG_ERRNO("epoll_ctl failed");
+        return -1;
+    }
+    return 0;
+}
+
+//Drop a connection from this worker's list and from its room
+static void reactor_forget(reactor_t *r, client_t *cl)
+{
+    room_leave(cl);
+    wheel_del(&r->wheel, &cl->timer);
+    if (cl->local_slot < 0)
+    {
+        return;
+    }
+    client_t *last = r->local[--r->nlocal];
+    r->local[cl->local_slot] = last;    //move the last connection into the hole
+    last->local_slot = cl->local_slot;
+    cl->local_slot = -1;
+}
+
+static unsigned long fanout_begin(void);
+static void fanout_end(msg_t *m, int n, unsigned long t0);
+
+//Send a message to every connection of this worker
+static void reactor_deliver(reactor_t *r, msg_t *m)
+{
+    unsigned long t0 = fanout_begin();
+    for (int i = 0; i < r->nlocal; i++)
+    {
+        client_send(r->local[i], m);
+    }
+    fanout_end(m, r->nlocal, t0);
+}
+
+static room_t *room_find(reactor_t *r, const char *name, unsigned int hash);
+static void uring_flush_posted(client_t *cl);
+
+//Run the tasks other threads posted to this worker
+static void reactor_drain(reactor_t *r)
+{
+    uint64_t val;
+    task_t *t;
+
+    if (!r->ring && read(r->wakefd, &val, sizeof(val)) < 0 && errno != EAGAIN)   //the ring read it already
+    {
+        LOG_ERRNO("eventfd read failed");
+    }
+    atomic_store(&r->wake_pending, 0);  //posts from now on signal again
+
+    while ((t = reactor_pop(r)))
+    {
+        client_t *cl = t->cl;
+        switch (t->kind)
+        {
+        case TASK_NEW:          //accepted connection, register and announce it
+            if (queue_add(cl) < 0)
+            {
+                LOG(LOG_WARN, "Max clients reached");
+                STAT_ADD(rejected, 1);
+                close(cl->connfd);
+                client_free(cl);
+                break;
+            }
+            LOG(LOG_INFO, "Client number [%d] has joined", cl->uid);     //server info
+            capture(r, cl->uid, CAPTURE_OPEN, NULL, 0);
+            reactor_notice(r, "[%s] has joined\r\n", cl->name);     //one broadcast for the whole batch
+            client_join(cl);        //greeting goes ahead of the room's scrollback
+            if (reactor_attach(r, cl, 1) < 0)
+            {
+                client_close(cl);
+                break;
+            }
+            if (r->ring)
+            {
+                client_flush(cl);   //the greeting was queued before the client had a worker
+                uring_recv(r, cl);
+            }
+            break;
+        case TASK_RESTORE:      //connection the previous process handed over
+            if (queue_add(cl) < 0)
+            {
+                STAT_ADD(rejected, 1);
+                close(cl->connfd);
+                client_free(cl);
+                break;
+            }
+            /* fall through */
+        case TASK_MOVE:         //connection changed to a room this worker owns
+            if (reactor_attach(r, cl, t->kind == TASK_MOVE) < 0)    //a restored one saw the scrollback already
+            {
+                client_close(cl);
+                break;
+            }
+            client_flush(cl);   //output queued before the move or the handover
+            switch (client_lines(cl))   //lines that arrived behind the room change
+            {
+            case -1:
+                client_close(cl);
+                break;
+            case 1:
+                client_handoff(cl);
+                break;
+            default:
+                if (r->ring && !cl->throttle_ns)
+                {
+                    uring_recv(r, cl);
+                }
+                break;
+            }
+            break;
+        case TASK_BROADCAST:    //message_all() from another worker
+            reactor_deliver(r, t->msg);
+            msg_unref(t->msg);
+            free(t);
+            break;
+        case TASK_ROOM:         //room line from another server
+        {
+            const char *name = ((room_task_t *)t)->room;
+            message(t->msg, 0, room_find(r, name, name_hash(name)));
+            free(t);
+            break;
+        }
+        case TASK_FLUSH:        //output another thread queued for a client of this worker
+            uring_flush_posted(cl);
+            break;
+        }
+    }
+}
+
+//Detach a connection from this worker after a room change if another worker
+//owns the new room; returns 1 when it must be handed over, which the caller
+//does with client_handoff() once it is done with it
+int client_move(client_t *cl)
+{
+    reactor_t *r = cl->reactor;
+    reactor_t *dst = room_reactor(cl->room);
+
+    if (dst == r)
+    {
+        room_join(cl, 1);
+        return 0;
+    }
+    reactor_forget(r, cl);
+    if (!r->ring)
+    {
+        epoll_ctl(r->epfd, EPOLL_CTL_DEL, cl->connfd, NULL);
+    }
+    pthread_mutex_lock(&cl->out_lock);
+    cl->reactor = NULL;         //in transit, the worker taking it flushes
+    pthread_mutex_unlock(&cl->out_lock);
+    return 1;
+}
+
+//Post a detached connection to the worker owning its room, the caller must
+//not touch it afterwards
+void client_handoff(client_t *cl)
+{
+    cl->handoff.kind = TASK_MOVE;
+    reactor_post(room_reactor(cl->room), &cl->handoff);
+}
+
+//Take a client_t from the pool, carving a new slab when the free list is empty
+//the outbound ring and lock are set up once per object and survive reuse
+static client_t *pool_get(void)
+{
+    client_t *cl;
+
+    pthread_mutex_lock(&pool_mutex);
+    if (!free_clients)
+    {
+        client_t *slab = NULL;
+        if (nslabs < MAX_SLABS)
+        {
+            slab = (client_t *)calloc(SLAB_CLIENTS, sizeof(client_t));
+        }
+        if (!slab)
+        {
+            pthread_mutex_unlock(&pool_mutex);
+            LOG(LOG_ERROR, "Cannot allocate more clients");
+            return NULL;
+        }
+        for (int i = SLAB_CLIENTS - 1; i >= 0; i--)
+        {
+            slab[i].next_free = free_clients;
+            free_clients = &slab[i];
+        }
+        slabs[nslabs++] = slab;
+    }
+    cl = free_clients;
+    free_clients = cl->next_free;
+    pthread_mutex_unlock(&pool_mutex);
+
+    if (!cl->outq)
+    {
+        cl->outq = (msg_t **)calloc(outq_limit, sizeof(msg_t *));
+        pthread_mutex_init(&cl->out_lock, NULL);
+        if (!cl->outq)
+        {
+            LOG_ERRNO("Cannot allocate memory");
+            pthread_mutex_lock(&pool_mutex);
+            cl->next_free = free_clients;
+            free_clients = cl;
+            pthread_mutex_unlock(&pool_mutex);
+            return NULL;
+        }
+    }
+    return cl;
+}
+
+//Allocate and initialize client details
+client_t *client_alloc(int connfd, struct sockaddr_in *addr)
+{
+    client_t *my_client = pool_get();
+    if (!my_client)
+    {
+        return NULL;
+    }
+    my_client ->out_head = 0;
+    my_client ->out_count = 0;
+    my_client ->out_off = 0;
+    my_client ->out_inflight = 0;
+    my_client ->free_pending = 0;
+    my_client ->flush_posted = 0;
+    my_client ->closing = 0;
+    my_client ->oper = 0;
+    my_client ->binary = 0;
+    my_client ->throttle_ns = 0;
+    my_client ->last_in_ns = now_ns();
+    my_client ->pinged = 0;
+    my_client ->timer.pprev = NULL;
+    my_client ->out_total = 0;
+    my_client ->stall_mark = ~0UL;
+    bucket_init(&my_client ->flood, &client_limit);
+    my_client ->inlen = 0;
+    my_client ->reactor = NULL;
+    my_client ->room_ptr = NULL;
+    my_client ->room_slot = -1;
+    my_client ->local_slot = -1;
+    my_client ->handoff.cl = my_client;
+    my_client ->flush.kind = TASK_FLUSH;
+    my_client ->flush.cl = my_client;
+    my_client ->addr = *addr;       //set address
+    snprintf(my_client ->room, sizeof(my_client ->room), "%s", default_room);
+    my_client ->connfd = connfd;    //unique fd for each client
+    my_client ->uid = atomic_fetch_add(&uid, 1);    //increment and store uid
+    sprintf(my_client ->name, "%d", my_client ->uid);
+    return my_client;
+}
+
+static void client_timer(reactor_t *r, client_t *cl);
+
+//Run every tick up to now_tick: spread the higher level slots the tick enters
+//over the levels below, then fire the timers of the tick
+static void wheel_run(reactor_t *r, unsigned long now_tick)
+{
+    wheel_t *w = &r->wheel;
+    wtimer_t *list, *t;
+
+    while (w->tick <= now_tick && w->count)
+    {
+        for (int level = 1; level < WHEEL_LEVELS && !(w->tick & ((1UL << (WHEEL_BITS * level)) - 1)); level++)
+        {
+            wheel_take(w, &w->slot[level][(w->tick >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1)], &list);
+            while ((t = list))
+            {
+                wheel_del(w, t);
+                wheel_add(w, t, t->expires);
+            }
+        }
+        wheel_take(w, &w->slot[0][w->tick & (WHEEL_SLOTS - 1)], &list);
+        w->tick++;              //timers set while firing go to later ticks
+        while ((t = list))
+        {
+            wheel_del(w, t);
+            client_timer(r, (client_t *)((char *)t - offsetof(client_t, timer)));
+        }
+    }
+    if (w->tick <= now_tick)
+    {
+        w->tick = now_tick + 1; //nothing scheduled, skip the idle ticks
+    }
+}
+
+//Pause reading a connection until wake, its buffered lines are kept
+static void reactor_throttle(reactor_t *r, client_t *cl, unsigned long wake)
+{
+    if (r->nthrottled == r->throttled_cap)
+    {
+        int cap = r->throttled_cap ? r->throttled_cap * 2 : 64;
+        client_t **throttled = (client_t **)realloc(r->throttled, cap * sizeof(client_t *));
+        if (!throttled)
+        {
+            LOG_ERRNO("Cannot allocate memory");
+            return;             //not paused, flood_check drops the line instead
+        }
+        r->throttled = throttled;
+        r->throttled_cap = cap;
+    }
+    cl->throttle_ns = wake;
+    r->throttled[r->nthrottled++] = cl;
+}
+
+//epoll_wait timeout in ms, until the next timer tick, the earliest paused
+//connection may go on or captured input is due to be written
+static int reactor_timeout(reactor_t *r)
+{
+    if (!r->nthrottled && !r->wheel.count && !r->capture_len)
+    {
+        return -1;
+    }
+    unsigned long now = now_ns(), next = r->wheel.count ? r->wheel.tick * TICK_NS : ~0UL;
+    if (r->capture_len && r->capture_ns + CAPTURE_FLUSH_NS < next)
+    {
+        next = r->capture_ns + CAPTURE_FLUSH_NS;
+    }
+    for (int i = 0; i < r->nthrottled; i++)
+    {
+        if (r->throttled[i]->throttle_ns < next)
+        {
+            next = r->throttled[i]->throttle_ns;
+        }
+    }
+    return next <= now ? 0 : (int)((next - now + 999999) / 1000000);
+}
+
+//Go on with every paused connection whose time has come
+static void reactor_resume(reactor_t *r)
+{
+    unsigned long now = now_ns();
+    for (int i = 0; i < r->nthrottled; )
+    {
+        client_t *cl = r->throttled[i];
+        if (cl->throttle_ns > now)
+        {
+            i++;
+            continue;
+        }
+        r->throttled[i] = r->throttled[--r->nthrottled];     //pausing again appends, past i
+        client_resume(cl);
+    }
+}
+
+static void client_abort(client_t *cl);
+
+//Whether the kernel has io_uring with everything the backend relies on; the
+//test ring is never mapped, so closing it frees it
+int uring_probe(void)
+{
+    struct io_uring_params p;
+
+    memset(&p, 0, sizeof(p));
+    int fd = syscall(__NR_io_uring_setup, 1, &p);
+    if (fd < 0)
+    {
+        return 0;
+    }
+    close(fd);
+    return (p.features & IORING_FEAT_EXT_ARG) != 0;     //timed waits in uring_enter()
+}
+
+//Set up a ring and map its queues, -1 when the kernel has no io_uring
+int uring_init(uring_t *u, unsigned entries)
+{
+    struct io_uring_params p;
+
+    memset(&p, 0, sizeof(p));
+    u->fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (u->fd < 0)
+    {
+        return -1;
+    }
+    size_t sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        sq_len = cq_len = sq_len > cq_len ? sq_len : cq_len;
+    }
+    char *sq = (char *)mmap(NULL, sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    char *cq = sq;
+    if (sq != MAP_FAILED && !(p.features & IORING_FEAT_SINGLE_MMAP))
+    {
+        cq = (char *)mmap(NULL, cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+    }
+    u->sqes = (struct io_uring_sqe *)mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                                          MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    if (sq == MAP_FAILED || cq == MAP_FAILED || u->sqes == MAP_FAILED)
+    {
+        close(u->fd);           //the mappings go with the last reference
+        return -1;
+    }
+    u->sq_head = (unsigned *)(sq + p.sq_off.head);
+    u->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    u->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    u->sq_entries = (unsigned *)(sq + p.sq_off.ring_entries);
+    u->sq_array = (unsigned *)(sq + p.sq_off.array);
+    u->tail = *u->sq_tail;
+    u->cq_head = (unsigned *)(cq + p.cq_off.head);
+    u->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    u->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    return 0;
+}
+
+//Make the entries filled so far visible to the kernel; done under freeze_lock,
+//so a hot restart never finds half filled entries
+static void uring_publish(uring_t *u)
+{
+    __atomic_store_n(u->sq_tail, u->tail, __ATOMIC_RELEASE);
+}
+
+//Submit the published entries and optionally wait for a completion, at most
+//timeout_ms when that is not negative
+static void uring_enter(uring_t *u, int wait, int timeout_ms)
+{
+    struct __kernel_timespec ts = { timeout_ms / 1000, (timeout_ms % 1000) * 1000000L };
+    struct io_uring_getevents_arg arg = { 0, 0, 0, timeout_ms >= 0 ? (uint64_t)(uintptr_t)&ts : 0 };
+    //exactly what is published, the kernel skips the wait when it submits fewer
+    unsigned submit = *u->sq_tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+
+    while (syscall(__NR_io_uring_enter, u->fd, submit, wait ? 1 : 0,
+                   (wait ? IORING_ENTER_GETEVENTS : 0) | IORING_ENTER_EXT_ARG, &arg, sizeof(arg)) < 0)
+    {
+        if (errno != EINTR && errno != ETIME && errno != EBUSY)
+        {
+            LOG_ERRNO("io_uring_enter failed");
+        }
+        if (errno != EINTR)
+        {
+            break;
+        }
+        submit = 0;
+    }
+}
+
+//Next free submission entry, cleared; submits what is queued when the queue is full
+static struct io_uring_sqe *uring_sqe(uring_t *u)
+{
+    if (u->tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) == *u->sq_entries)
+    {
+        uring_publish(u);
+        uring_enter(u, 0, -1);
+    }
+    unsigned idx = u->tail & *u->sq_mask;
+    struct io_uring_sqe *sqe = &u->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    u->sq_array[idx] = idx;
+    u->tail++;
+    return sqe;
+}
+
+//Read the eventfd through the ring, completes when another thread posts
+static void uring_wake(reactor_t *r)
+{
+    struct io_uring_sqe *sqe = uring_sqe(r->ring);
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = r->wakefd;
+    sqe->addr = (uintptr_t)&r->wake_val;
+    sqe->len = sizeof(r->wake_val);
+    sqe->user_data = URING_WAKE;
+    r->ring_ops++;
+}
+
+//Receive straight into the client's input buffer; it is already per client
+//and sized for one line, so a provided buffer would only add a copy
+void uring_recv(reactor_t *r, client_t *cl)
+{
+    struct io_uring_sqe *sqe = uring_sqe(r->ring);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = cl->connfd;
+    sqe->addr = (uintptr_t)(cl->inbuf + cl->inlen);
+    sqe->len = sizeof(cl->inbuf) - 1 - cl->inlen;
+    sqe->user_data = (uintptr_t)cl | URING_RECV;
+    r->ring_ops++;
+}
+
+//Queue a writev of the head of the outbound queue on this worker's ring,
+//one at a time per client; called with out_lock held
+void uring_send(reactor_t *r, client_t *cl)
+{
+    if (cl->out_inflight || !cl->out_count || cl->closing)
+    {
+        return;
+    }
+    int cnt = cl->out_count < URING_IOV ? cl->out_count : URING_IOV;
+    for (int i = 0; i < cnt; i++)
+    {
+        msg_t *m = cl->outq[(cl->out_head + i) % outq_limit];
+        cl->out_iov[i].iov_base = m->data;
+        cl->out_iov[i].iov_len = m->len;
+    }
+    cl->out_iov[0].iov_base = (char *)cl->out_iov[0].iov_base + cl->out_off;
+    cl->out_iov[0].iov_len -= cl->out_off;
+
+    struct io_uring_sqe *sqe = uring_sqe(r->ring);
+    sqe->opcode = IORING_OP_WRITEV;
+    sqe->fd = cl->connfd;
+    sqe->addr = (uintptr_t)cl->out_iov;
+    sqe->len = cnt;
+    sqe->user_data = (uintptr_t)cl | URING_SEND;
+    cl->out_inflight = cnt;
+    r->ring_ops++;
+}
+
+//Send a client's output on the ring of the worker owning it, so its completion
+//comes back there; other threads post the flush to that worker, and a client
+//between workers is flushed by the one taking it. Called with out_lock held
+static void uring_flush(client_t *cl)
+{
+    reactor_t *owner = cl->reactor;
+
+    if (owner && owner == current_reactor)
+    {
+        uring_send(owner, cl);
+    }
+    else if (owner && !cl->flush_posted && !cl->closing && cl->out_count && !cl->out_inflight)
+    {
+        cl->flush_posted = 1;
+        reactor_post(owner, &cl->flush);
+    }
+}
+
+//Run a flush another thread posted, or finish freeing a client that was
+//closed while the task waited
+static void uring_flush_posted(client_t *cl)
+{
+    pthread_mutex_lock(&cl->out_lock);
+    cl->flush_posted = 0;
+    if (cl->free_pending)
+    {
+        int last = !cl->out_inflight;
+        pthread_mutex_unlock(&cl->out_lock);
+        if (last)
+        {
+            close(cl->connfd);
+            client_free(cl);
+        }
+        return;
+    }
+    uring_flush(cl);
+    pthread_mutex_unlock(&cl->out_lock);
+}
+
+//A recv completed: handle the lines and read on unless the client quit,
+//moved to another worker or was paused
+static void uring_received(reactor_t *r, client_t *cl, int res)
+{
+    if (res == -EINTR || res == -EAGAIN)
+    {
+        uring_recv(r, cl);
+        return;
+    }
+    if (res <= 0)
+    {
+        client_close(cl);   //peer closed or read error
+        return;
+    }
+    capture(r, cl->uid, CAPTURE_DATA, cl->inbuf + cl->inlen, res);
+    cl->inlen += res;
+    cl->last_in_ns = now_ns();
+    cl->pinged = 0;
+    STAT_ADD(bytes_in, res);
+    switch (client_lines(cl))
+    {
+    case -1:
+        client_close(cl);
+        return;
+    case 1:
+        client_handoff(cl);
+        return;
+    }
+    if (!cl->throttle_ns)
+    {
+        uring_recv(r, cl);
+    }
+}
+
+//A writev completed: release what went out and queue the rest, or finish
+//closing a client that went away meanwhile
+static void uring_sent(reactor_t *r, client_t *cl, int res)
+{
+    pthread_mutex_lock(&cl->out_lock);
+    cl->out_inflight = 0;
+    if (res < 0)
+    {
+        if (res != -EPIPE && res != -ECONNRESET && res != -EINTR && res != -EAGAIN && !cl->closing)
+        {
+            LOG(LOG_ERROR, "Write to descriptor failed: %s", strerror(-res));
+        }
+        if (res != -EINTR && res != -EAGAIN)
+        {
+            client_abort(cl);
+        }
+    }
+    else
+    {
+        outq_advance(cl, res);
+    }
+    if (cl->free_pending)
+    {
+        int last = !cl->flush_posted;
+        pthread_mutex_unlock(&cl->out_lock);
+        if (last)
+        {
+            close(cl->connfd);
+            client_free(cl);
+        }
+        return;
+    }
+    uring_flush(cl);            //on the new owner's ring if the client moved meanwhile
+    pthread_mutex_unlock(&cl->out_lock);
+}
+
+//Worker loop on io_uring: each io_uring_enter submits everything queued
+//since the last one, so a room fan-out costs one syscall instead of one per member
+void uring_loop(reactor_t *r)
+{
+    uring_t *u = r->ring;
+
+    pthread_rwlock_rdlock(&freeze_lock);
+    uring_wake(r);
+    while (1)
+    {
+        int timeout = reactor_timeout(r);
+        uring_publish(u);
+        pthread_rwlock_unlock(&freeze_lock);
+        uring_enter(u, 1, timeout);
+        pthread_rwlock_rdlock(&freeze_lock);
+
+        unsigned head = *u->cq_head;
+        unsigned tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++)
+        {
+            struct io_uring_cqe *cqe = &u->cqes[head & *u->cq_mask];
+            r->ring_ops--;
+            client_t *cl = (client_t *)(uintptr_t)(cqe->user_data & ~(uint64_t)(URING_TAGS - 1));
+            switch (cqe->user_data & (URING_TAGS - 1))
+            {
+            case URING_WAKE:
+                reactor_drain(r);       //tasks posted by acceptors and other workers
+                uring_wake(r);
+                break;
+            case URING_RECV:
+                uring_received(r, cl, cqe->res);    //may hand cl to another worker or free it
+                break;
+            case URING_SEND:
+                uring_sent(r, cl, cqe->res);
+                break;
+            }
+        }
+        __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+        reactor_resume(r);          //connections whose flood control pause is over
+        wheel_run(r, now_ns() / TICK_NS);   //idle, unanswered and stalled connections
+        reactor_flush_notices(r);   //leave notices from this batch
+        capture_flush(r, 0);
+    }
+}
+
+//Acceptor on io_uring: one multishot accept yields every connection without
+//a syscall each; returns -1 right away when the kernel cannot do that
+int uring_accept_loop(acceptor_t *a)
+{
+    uring_t *u = (uring_t *)malloc(sizeof(uring_t));
+    struct sockaddr_in cli_addr;
+    int armed = 0;
+
+    if (!u || uring_init(u, 64) < 0)
+    {
+        free(u);
+        return -1;
+    }
+    pthread_rwlock_rdlock(&freeze_lock);
+    a->ring = u;
+    while (1)
+    {
+        if (!armed)
+        {
+            struct io_uring_sqe *sqe = uring_sqe(u);
+            sqe->opcode = IORING_OP_ACCEPT;
+            sqe->fd = a->listenfd;
+            sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+            sqe->accept_flags = SOCK_NONBLOCK;
+            sqe->user_data = URING_ACCEPT;
+            uring_publish(u);
+            armed = 1;
+        }
+        pthread_rwlock_unlock(&freeze_lock);
+        uring_enter(u, 1, -1);
+        pthread_rwlock_rdlock(&freeze_lock);
+
+        unsigned head = *u->cq_head;
+        unsigned tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++)
+        {
+            struct io_uring_cqe *cqe = &u->cqes[head & *u->cq_mask];
+            if (!(cqe->flags & IORING_CQE_F_MORE))
+            {
+                armed = 0;      //the multishot accept ended, arm another
+            }
+            if (cqe->res >= 0)
+            {
+                //the shared address buffer is overwritten by every accept, ask the socket
+                socklen_t clientlength = sizeof(cli_addr);
+                if (getpeername(cqe->res, (struct sockaddr*)&cli_addr, &clientlength) < 0)
+                {
+                    memset(&cli_addr, 0, sizeof(cli_addr));
+                }
+                accept_client(cqe->res, &cli_addr);
+            }
+            else if (cqe->res == -EMFILE || cqe->res == -ENFILE)
+            {
+                LOG(LOG_ERROR, "Accept failed: %s", strerror(-cqe->res));
+                accept_shed(a->listenfd);
+            }
+            else if (cqe->res == -EINVAL)
+            {
+                a->ring = NULL;     //no multishot accept on this kernel
+                pthread_rwlock_unlock(&freeze_lock);
+                close(u->fd);
+                free(u);
+                return -1;
+            }
+            else if (cqe->res != -EAGAIN && cqe->res != -EINTR && cqe->res != -ECONNABORTED)
+            {
+                LOG(LOG_ERROR, "Accept failed: %s", strerror(-cqe->res));
+            }
+        }
+        __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+    }
+}
+
+// Worker thread: wait for readable connections and dispatch them
+void *reactor_loop(void *arg)
+{
+    reactor_t *r = (reactor_t *)arg;
+    struct epoll_event events[MAX_EVENTS];
+
+    current_reactor = r;
+    my_stats = &r->stats;
+    log_thread("w%d", (int)(r - reactors));
+    if (r->ring)
+    {
+        uring_loop(r);
+        return NULL;
+    }
+    while (1)
+    {
+        int n = epoll_wait(r->epfd, events, MAX_EVENTS, reactor_timeout(r));
+        if (n < 0)
+        {
+            if (errno != EINTR)
+            {
+                LOG_ERRNO("epoll_wait failed");
+            }
+            continue;
+        }
+        pthread_rwlock_rdlock(&freeze_lock);
+        for (int i = 0; i < n; i++)
+        {
+            client_t *cl = (client_t *)events[i].data.ptr;
+            if (!cl)
+            {
+                reactor_drain(r);       //tasks posted by acceptors and other workers
+                continue;
+            }
+            if (events[i].events & EPOLLOUT)
+            {
+                client_flush(cl);   //socket became writable, drain the queue
+            }
+            if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+            {
+                client_read(cl);    //may hand cl to another worker or free it
+            }
+        }
+        reactor_resume(r);          //connections whose flood control pause is over
+        wheel_run(r, now_ns() / TICK_NS);   //idle, unanswered and stalled connections
+        reactor_flush_notices(r);   //leave notices from this batch
+        capture_flush(r, 0);
+        pthread_rwlock_unlock(&freeze_lock);
+    }
+
+    return NULL;
+}
+
+
+//Grow the uid index so chains stay short, called with clients_lock held for writing
+static int uid_index_grow(void)
+{
+    unsigned int buckets = uid_buckets ? uid_buckets * 2 : 1024;
+    client_t **index = (client_t **)calloc(buckets, sizeof(client_t *));
+    if (!index)
+    {
+        LOG_ERRNO("Cannot allocate memory");
+        return -1;
+    }
+    for (unsigned int i = 0; i < uid_buckets; i++)
+    {
+        client_t *cl, *next;
+        for (cl = uid_index[i]; cl; cl = next)
+        {
+            next = cl->next_uid;
+            cl->next_uid = index[cl->uid & (buckets - 1)];
+            index[cl->uid & (buckets - 1)] = cl;
+        }
+    }
+    free(uid_index);
+    uid_index = index;
+    uid_buckets = buckets;
+    return 0;
+}
+
+// Add client to queue, returns -1 when the server is full
+int queue_add(client_t *cl)
+{
+    pthread_rwlock_wrlock(&clients_lock);
+    if (max_clients && client_count >= max_clients)
+    {
+        pthread_rwlock_unlock(&clients_lock);
+        return -1;
+    }
+    if (client_count == clients_cap)
+    {
+        unsigned int cap = clients_cap ? clients_cap * 2 : 1024;
+        client_t **grown = (client_t **)realloc(clients, cap * sizeof(client_t *));
+        if (!grown)
+        {
+            LOG_ERRNO("Cannot allocate memory");
+            pthread_rwlock_unlock(&clients_lock);
+            return -1;
+        }
+        clients = grown;
+        clients_cap = cap;
+    }
+    if (client_count >= uid_buckets && uid_index_grow() < 0)
+    {
+        pthread_rwlock_unlock(&clients_lock);
+        return -1;
+    }
+
+    cl->slot = client_count;
+    clients[client_count++] = cl;
+    cl->next_uid = uid_index[cl->uid & (uid_buckets - 1)];
+    uid_index[cl->uid & (uid_buckets - 1)] = cl;
+    atomic_fetch_add(&roster_gen, 1);
+    relay_user(cl);
+    pthread_rwlock_unlock(&clients_lock);
+    return 0;
+}
+
+//Delete the client from queue 
+void queue_delete(int uid)
+{
+    pthread_rwlock_wrlock(&clients_lock);
+    if (!uid_buckets)
+    {
+        pthread_rwlock_unlock(&clients_lock);
+        return;
+    }
+    client_t **link = &uid_index[uid & (uid_buckets - 1)];
+    while (*link && (*link)->uid != uid)
+    {
+        link = &(*link)->next_uid;
+    }
+    client_t *cl = *link;
+    if (cl)
+    {
+        *link = cl->next_uid;       //unlink from the uid index
+
+        client_t *last = clients[--client_count];
+        clients[cl->slot] = last;   //move the last client into the hole
+        last->slot = cl->slot;
+        atomic_fetch_add(&roster_gen, 1);
+        relay_quit(uid);
+    }
+    pthread_rwlock_unlock(&clients_lock);
+}
+
+//Look up a connected client by uid, called with clients_lock held
+client_t *client_find(int uid)
+{
+    if (!uid_buckets)
+    {
+        return NULL;
+    }
+    client_t *cl = uid_index[uid & (uid_buckets - 1)];
+    while (cl && cl->uid != uid)
+    {
+        cl = cl->next_uid;
+    }
+    return cl;
+}
+
+//FNV-1a over a NUL terminated string, for room names and command words
+unsigned int name_hash(const char *s)
+{
+    unsigned int h = 2166136261u;
+    while (*s)
+    {
+        h = (h ^ (unsigned char)*s++) * 16777619u;
+    }
+    return h;
+}
+
+//Grow a worker's room table so chains stay short
+static int room_table_grow(reactor_t *r)
+{
+    unsigned int buckets = r->room_buckets ? r->room_buckets * 2 : ROOM_BUCKETS_MIN;
+    room_t **table = (room_t **)calloc(buckets, sizeof(room_t *));
+    if (!table)
+    {
+        LOG_ERRNO("Cannot allocate memory");
+        return -1;
+    }
+    for (unsigned int i = 0; i < r->room_buckets; i++)
+    {
+        room_t *room, *next;
+        for (room = r->rooms[i]; room; room = next)
+        {
+            next = room->next;
+            room->next = table[room->hash & (buckets - 1)];
+            table[room->hash & (buckets - 1)] = room;
+        }
+    }
+    free(r->rooms);
+    r->rooms = table;
+    r->room_buckets = buckets;
+    return 0;
+}
+
+//Map the scrollback segment of a room, from log_dir when set so it survives
+//restarts and anonymous otherwise; the file name is the room name in hex
+static scrollback_t *scrollback_open(const char *name)
+{
+    size_t len = sizeof(scrollback_t) + SCROLLBACK_SZ;
+    scrollback_t *sb;
+
+    if (log_dir)
+    {
+        char path[PATH_MAX];
+        int n = snprintf(path, sizeof(path), "%s/", log_dir);
+        for (const char *c = name; *c && n < (int)sizeof(path) - 8; c++)
+        {
+            n += snprintf(path + n, sizeof(path) - n, "%02x", (unsigned char)*c);
+        }
+        snprintf(path + n, sizeof(path) - n, ".log");
+
+        int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (fd < 0)
+        {
+            LOG_ERRNO("Cannot open scrollback");
+            return NULL;
+        }
+        if (ftruncate(fd, len) < 0)
+        {
+            LOG_ERRNO("Cannot size scrollback");
+            close(fd);
+            return NULL;
+        }
+        //populate now so appends on the chat path never fault the file in
+        sb = (scrollback_t *)mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, 0);
+        close(fd);
+    }
+    else
+    {
+        sb = (scrollback_t *)mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    }
+    if (sb == MAP_FAILED)
+    {
+        LOG_ERRNO("Cannot map scrollback");
+        return NULL;
+    }
+    if (sb->magic != SCROLLBACK_MAGIC || sb->size != SCROLLBACK_SZ)
+    {
+        sb->head = 0;
+        sb->size = SCROLLBACK_SZ;
+        sb->magic = SCROLLBACK_MAGIC;
+    }
+    return sb;
+}
+
+//Copy a line into the room's ring, overwriting the oldest bytes
+static void scrollback_append(room_t *room, const char *s, size_t len)
+{
+    scrollback_t *sb = room->log;
+    if (!sb || len >= sb->size)
+    {
+        return;
+    }
+    size_t pos = sb->head % sb->size;
+    size_t first = len < sb->size - pos ? len : sb->size - pos;
+    memcpy(sb->data + pos, s, first);
+    memcpy(sb->data, s + first, len - first);
+    sb->head += len;
+
+    if (room->replay)       //stale now, the next join builds a new one
+    {
+        msg_unref(room->replay);
+        room->replay = NULL;
+    }
+}
+
+static void msg_header(msg_t *m, size_t len);
+
+//Recent lines of a room as one message, oldest first and starting at a whole
+//line; built once and shared until the next line, NULL when there are none
+static msg_t *scrollback_replay(room_t *room)
+{
+    scrollback_t *sb = room->log;
+    if (room->replay || !sb || !sb->head)
+    {
+        return room->replay;
+    }
+    size_t len = sb->head < sb->size ? sb->head : sb->size;
+    size_t start = (sb->head - len) % sb->size;
+    size_t first = len < sb->size - start ? len : sb->size - start;
+
+    msg_t *m = (msg_t *)malloc(sizeof(msg_t) + len + 1);
+    if (!m)
+    {
+        LOG_ERRNO("Cannot allocate memory");
+        return NULL;
+    }
+    msg_header(m, len);         //kept for later joins, no line of theirs to trace
+    memcpy(m->data, sb->data + start, first);
+    memcpy(m->data + first, sb->data, len - first);
+    if (sb->head > sb->size)
+    {
+        //the ring has wrapped, drop what is left of the oldest line
+        char *nl = (char *)memchr(m->data, '\n', len);
+        size_t skip = nl ? nl + 1 - m->data : len;
+        memmove(m->data, m->data + skip, len - skip);
+        len -= skip;
+    }
+    m->len = len;
+    m->data[len] = '\0';
+    room->replay = m;
+    return m;
+}
+
+//Find a room of this worker by name, NULL when nobody is in it
+static room_t *room_find(reactor_t *r, const char *name, unsigned int hash)
+{
+    if (r->room_buckets)
+    {
+        for (room_t *room = r->rooms[hash & (r->room_buckets - 1)]; room; room = room->next)
+        {
+            if (room->hash == hash && !strcmp(room->name, name))
+            {
+                return room;
+            }
+        }
+    }
+    return NULL;
+}
+
+//Find a room of this worker by name, creating it on first use; NULL when out of memory
+static room_t *room_get(reactor_t *r, const char *name)
+{
+    unsigned int hash = name_hash(name);
+    room_t *room = room_find(r, name, hash);
+
+    if (room)
+    {
+        return room;
+    }
+    if (r->nrooms >= r->room_buckets && room_table_grow(r) < 0)
+    {
+        return NULL;
+    }
+    room = (room_t *)calloc(1, sizeof(room_t));
+    if (!room)
+    {
+        LOG_ERRNO("Cannot allocate memory");
+        return NULL;
+    }
+    snprintf(room->name, sizeof(room->name), "%s", name);
+    room->hash = hash;
+    bucket_init(&room->flood, &room_limit);
+    room->log = scrollback_open(name);
+    room->next = r->rooms[hash & (r->room_buckets - 1)];
+    r->rooms[hash & (r->room_buckets - 1)] = room;
+    r->nrooms++;
+    return room;
+}
+
+//Unlink an empty room from its worker's table and free it
+static void room_free(reactor_t *r, room_t *room)
+{
+    room_t **link = &r->rooms[room->hash & (r->room_buckets - 1)];
+    while (*link != room)
+    {
+        link = &(*link)->next;
+    }
+    *link = room->next;
+    r->nrooms--;
+    if (room->replay)
+    {
+        msg_unref(room->replay);
+    }
+    if (room->log)
+    {
+        munmap(room->log, sizeof(scrollback_t) + SCROLLBACK_SZ);
+    }
+    free(room->members);
+    free(room);
+}
+
+//Add a client to the member list of its room and, for a client that just
+//came in, replay what was said there; called by the worker owning the room
+void room_join(client_t *cl, int replay)
+{
+    room_t *room = room_get(cl->reactor, cl->room);
+    if (!room)
+    {
+        cl->room_ptr = NULL;    //not indexed, room_leave skips it
+        cl->room_slot = -1;
+        return;
+    }
+    if (room->count == room->cap)
+    {
+        int cap = room->cap ? room->cap * 2 : 16;
+        client_t **members = (client_t **)realloc(room->members, cap * sizeof(client_t *));
+        if (!members)
+        {
+            LOG_ERRNO("Cannot allocate memory");
+            if (!room->count)
+            {
+                room_free(cl->reactor, room);
+            }
+            cl->room_ptr = NULL;
+            cl->room_slot = -1;
+            return;
+        }
+        room->members = members;
+        room->cap = cap;
+    }
+    cl->room_ptr = room;
+    cl->room_slot = room->count;
+    room->members[room->count++] = cl;
+
+    msg_t *recent = replay ? scrollback_replay(room) : NULL;
+    if (recent)
+    {
+        client_send(cl, recent);
+    }
+}
+
+//Remove a client from its room in O(1), called by the worker owning the room
+//the room goes away with its last member
+void room_leave(client_t *cl)
+{
+    room_t *room = cl->room_ptr;
+    if (!room)
+    {
+        return;
+    }
+    client_t *last = room->members[--room->count];
+    room->members[cl->room_slot] = last;    //move the last member into the hole
+    last->room_slot = cl->room_slot;
+    cl->room_ptr = NULL;
+    cl->room_slot = -1;
+    if (!room->count)
+    {
+        room_free(cl->reactor, room);
+    }
+}
+
+//Set up a new message's header, not traced
+static void msg_header(msg_t *m, size_t len)
+{
+    atomic_init(&m->refs, 1);
+    m->op = FRAME_TEXT;
+    m->room_len = 0;
+    m->body_off = 0;
+    atomic_init(&m->frame, NULL);
+    m->uid = 0;
+    m->line_ns = 0;
+    m->parse_ns = 0;
+    atomic_init(&m->fanout_ns, 0);
+    atomic_init(&m->lock_ns, 0);
+    atomic_init(&m->sends, 0);
+    m->len = len;
+}
+
+//Set up a new message's header; one formatted while handling a line is
+//traced back to it
+static void msg_init(msg_t *m, size_t len)
+{
+    msg_header(m, len);
+    m->uid = my_line_uid;
+    m->line_ns = my_line_ns;
+    if (m->line_ns)
+    {
+        m->parse_ns = now_ns() - m->line_ns;
+        hist_add(&my_stats->parse_ns, m->parse_ns);
+        PROBE2(parse, m->uid, m->parse_ns);
+    }
+}
+
+//Create a message holding a copy of s, the caller owns the only reference
+msg_t *msg_new(const char *s, size_t len)
+{
+    msg_t *m = (msg_t *)malloc(sizeof(msg_t) + len + 1);
+    if (!m)
+    {
+        LOG_ERRNO("Cannot allocate memory");
+        return NULL;
+    }
+    msg_init(m, len);
+    memcpy(m->data, s, len);
+    m->data[len] = '\0';
+    return m;
+}
+
+//Format a message straight into its shared buffer
+msg_t *msg_printf(const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    int len = vsnprintf(NULL, 0, fmt, ap);
+    va_end(ap);
+    if (len < 0)
+    {
+        return NULL;
+    }
+
+    msg_t *m = (msg_t *)malloc(sizeof(msg_t) + len + 1);
+    if (!m)
+    {
+        LOG_ERRNO("Cannot allocate memory");
+        return NULL;
+    }
+    msg_init(m, len);
+    va_start(ap, fmt);
+    vsnprintf(m->data, len + 1, fmt, ap);
+    va_end(ap);
+    return m;
+}
+
+//Format a chat line or whisper of a client, remembering where its text starts
+//and its room so binary recipients get the fields instead of the text
+msg_t *msg_say(int op, const client_t *from, const char *text, size_t n)
+{
+    const char *fmt = op == FRAME_PRIV ? "> [%s][whisper] " : "> [%s] ";
+    int head = snprintf(NULL, 0, fmt, from->name);
+    size_t room_len = op == FRAME_CHAT ? strlen(from->room) : 0;
+    size_t len = head + n + 2;
+
+    msg_t *m = (msg_t *)malloc(sizeof(msg_t) + len + 1 + room_len);
+    if (!m)
+    {
+        LOG_ERRNO("Cannot allocate memory");
+        return NULL;
+    }
+    msg_init(m, len);
+    m->op = op;
+    m->uid = from->uid;
+    m->body_off = head;
+    m->room_len = room_len;
+    snprintf(m->data, head + 1, fmt, from->name);
+    memcpy(m->data + head, text, n);
+    memcpy(m->data + head + n, "\r\n", 3);
+    memcpy(m->data + len + 1, from->room, room_len);
+    return m;
+}
+
+//Build a binary frame as a message of its own
+static msg_t *frame_new(int op, int uid, const char *room, size_t room_len, const char *body, size_t n)
+{
+    size_t len = FRAME_HDR + room_len + n;
+    msg_t *f = (msg_t *)malloc(sizeof(msg_t) + len + 1);
+    if (!f)
+    {
+        LOG_ERRNO("Cannot allocate memory");
+        return NULL;
+    }
+    msg_header(f, len);         //traced through the message it was made from
+    f->op = FRAME_RAW;
+    f->uid = uid;
+    uint32_t word = htonl(len);
+    memcpy(f->data, &word, 4);
+    f->data[4] = op;
+    f->data[5] = room_len;
+    f->data[6] = f->data[7] = 0;
+    word = htonl(uid);
+    memcpy(f->data + 8, &word, 4);
+    memcpy(f->data + FRAME_HDR, room, room_len);
+    memcpy(f->data + FRAME_HDR + room_len, body, n);
+    f->data[len] = '\0';
+    return f;
+}
+
+//Binary form of a message, made once and shared by every binary recipient;
+//NULL when out of memory
+static msg_t *msg_frame(msg_t *m)
+{
+    if (m->op == FRAME_RAW)
+    {
+        return m;
+    }
+    msg_t *f = atomic_load_explicit(&m->frame, memory_order_acquire);
+    if (f)
+    {
+        return f;
+    }
+    size_t n = m->op == FRAME_TEXT ? m->len : m->len - m->body_off - 2;    //without "> [name] " and \r\n
+    f = frame_new(m->op, m->op == FRAME_TEXT ? 0 : m->uid, m->data + m->len + 1, m->room_len,
+                  m->data + m->body_off, n);
+    msg_t *none = NULL;
+    if (f && !atomic_compare_exchange_strong(&m->frame, &none, f))
+    {
+        free(f);                //another recipient's thread made it first
+        f = none;
+    }
+    return f;
+}
+
+//Account for a traced message whose last queue let go of it: written to,
+//or dropped by, its last recipient
+static void msg_delivered(msg_t *m)
+{
+    unsigned long total = now_ns() - m->line_ns;
+    unsigned long fanout = atomic_load_explicit(&m->fanout_ns, memory_order_relaxed);
+    unsigned long lock = atomic_load_explicit(&m->lock_ns, memory_order_relaxed);
+
+    hist_add(&my_stats->deliver_ns, total);
+    PROBE5(deliver, m->uid, total, m->parse_ns, fanout, lock);
+    if (trace_fd >= 0 && atomic_fetch_add_explicit(&trace_seq, 1, memory_order_relaxed) % trace_every == 0)
+    {
+        log_write(LOG_TRACE, "uid=%d len=%zu sends=%d parse_ns=%lu lock_ns=%lu fanout_ns=%lu deliver_ns=%lu",
+                  m->uid, m->len, atomic_load_explicit(&m->sends, memory_order_relaxed), m->parse_ns, lock,
+                  fanout, total);
+    }
+}
+
+//Drop a reference, the last one frees the buffer
+void msg_unref(msg_t *m)
+{
+    if (atomic_fetch_sub_explicit(&m->refs, 1, memory_order_acq_rel) == 1)
+    {
+        if (m->line_ns)
+        {
+            msg_delivered(m);
+        }
+        if (atomic_load_explicit(&m->frame, memory_order_relaxed))
+        {
+            msg_unref(atomic_load_explicit(&m->frame, memory_order_relaxed));
+        }
+        free(m);
+    }
+}
+
+//Start timing a fan-out on this thread
+static unsigned long fanout_begin(void)
+{
+    my_lock_ns = 0;
+    return now_ns();
+}
+
+//Finish timing a fan-out that queued m n times since t0
+static void fanout_end(msg_t *m, int n, unsigned long t0)
+{
+    unsigned long ns = now_ns() - t0;
+
+    hist_add(&my_stats->fanout_ns, ns);
+    if (m->line_ns)
+    {
+        atomic_fetch_add_explicit(&m->fanout_ns, ns, memory_order_relaxed);
+        atomic_fetch_add_explicit(&m->lock_ns, my_lock_ns, memory_order_relaxed);
+        atomic_fetch_add_explicit(&m->sends, n, memory_order_relaxed);
+        PROBE4(fanout, m->uid, n, ns, my_lock_ns);
+    }
+}
+
+//message all but the sender who are in same room, consumes the caller's reference
+//runs on the worker owning the room, so the member list needs no lock
+void message(msg_t *m, int uid, room_t *room)
+{
+    if (!m)
+    {
+        return;
+    }
+    if (!room)
+    {
+        msg_unref(m);
+        return;
+    }
+    unsigned long t0 = fanout_begin();
+    scrollback_append(room, m->data, m->len);
+    int n = 0;
+    for (int i = 0; i < room->count; i++) 
+    {
+        if (room->members[i]->uid != uid)   //if not self
+        {
+            client_send(room->members[i], m);
+            n++;
+        }
+    }
+    fanout_end(m, n, t0);
+    msg_unref(m);
+}
+
+//message all, on every server of the federation, consumes the caller's reference
+void message_all(msg_t *m)
+{
+    if (m)
+    {
+        relay_all(m);
+    }
+    message_local(m);
+}
+
+//message all clients of this server, consumes the caller's reference
+//the calling worker delivers to its own clients, the others get a task
+void message_local(msg_t *m)
+{
+    if (!m)
+    {
+        return;
+    }
+    for (int i = 0; i < nreactors; i++)
+    {
+        reactor_t *r = &reactors[i];
+        if (r == current_reactor)
+        {
+            reactor_deliver(r, m);
+            continue;
+        }
+        task_t *t = (task_t *)malloc(sizeof(task_t));
+        if (!t)
+        {
+            LOG_ERRNO("Cannot allocate memory");
+            continue;
+        }
+        t->kind = TASK_BROADCAST;
+        t->cl = NULL;
+        t->msg = m;
+        atomic_fetch_add_explicit(&m->refs, 1, memory_order_relaxed);
+        reactor_post(r, t);
+    }
+    msg_unref(m);
+}
+
+// message sender
+void message_self(const char *s, client_t *cl)
+{
+    msg_t *m = msg_new(s, strlen(s));
+    if (m)
+    {
+        client_send(cl, m);
+        msg_unref(m);
+    }
+}
+
+//Message select client, consumes the caller's reference
+void message_client(msg_t *m, int uid)
+{
+    if (!m)
+    {
+        return;
+    }
+    unsigned long t0 = fanout_begin();
+    pthread_rwlock_rdlock(&clients_lock);     //keeps cl from being freed while we send
+    client_t *cl = client_find(uid);
+    if (cl)
+    {
+        client_send(cl, m);
+    }
+    pthread_rwlock_unlock(&clients_lock);
+    fanout_end(m, cl != NULL, t0);
+    msg_unref(m);
+}
+
+//Copy a user into a roster snapshot
+static void roster_entry(roster_entry_t *e, int uid, const char *name, const char *room)
+{
+    e->uid = uid;
+    memcpy(e->name, name, sizeof(e->name));
+    memcpy(e->room, room, sizeof(e->room));
+}
+
+//Render the registry and the users of linked servers into a new snapshot; the
+//read locks are held only to copy the users out, formatting runs unlocked
+static roster_t *roster_build(void)
+{
+    pthread_rwlock_rdlock(&clients_lock);
+    pthread_rwlock_rdlock(&relay_lock);
+    unsigned int count = client_count + remote_count;
+    unsigned long gen = atomic_load(&roster_gen);   //stable, writers hold the locks exclusively
+    roster_entry_t *users = (roster_entry_t *)malloc((count + 1) * sizeof(roster_entry_t));
+    if (!users)
+    {
+        pthread_rwlock_unlock(&relay_lock);
+        pthread_rwlock_unlock(&clients_lock);
+        LOG_ERRNO("Cannot allocate memory");
+        return NULL;
+    }
+    unsigned int n = 0;
+    for (unsigned int i = 0; i < client_count; i++)
+    {
+        roster_entry(&users[n++], clients[i]->uid, clients[i]->name, clients[i]->room);
+    }
+    for (unsigned int i = 0; remote_count && i < REMOTE_BUCKETS; i++)
+    {
+        for (remote_t *u = remotes[i]; u; u = u->next)
+        {
+            roster_entry(&users[n++], u->uid, u->name, u->room);
+        }
+    }
+    pthread_rwlock_unlock(&relay_lock);
+    pthread_rwlock_unlock(&clients_lock);
+
+    size_t cap = (size_t)count * (32 + 2 * ROOM_NAME_SZ) + 1;  //uid, name, room and decoration
+    roster_t *ro = (roster_t *)malloc(sizeof(roster_t) + cap);
+    size_t *offs = (size_t *)malloc((count + 1) * sizeof(size_t));
+    if (!ro || !offs)
+    {
+        LOG_ERRNO("Cannot allocate memory");
+        free(users);
+        free(ro);
+        free(offs);
+        return NULL;
+    }
+    size_t len = 0;
+    for (unsigned int i = 0; i < count; i++)
+    {
+        offs[i] = len;
+        len += snprintf(ro->text + len, cap - len, "[%d] %s - room: %s\r\n", users[i].uid, users[i].name, users[i].room);
+    }
+    free(users);
+
+    ro->gen = gen;
+    offs[count] = len;
+    atomic_init(&ro->refs, 1);
+    ro->count = count;
+    ro->offs = offs;
+    return ro;
+}
+
+//Take a reference to a roster no older than the registry; rebuilt only when
+//a client joined, left or changed name or room since the last one
+roster_t *roster_get(void)
+{
+    pthread_mutex_lock(&roster_mutex);
+    roster_t *ro = roster;
+    if (ro && ro->gen == atomic_load(&roster_gen))
+    {
+        atomic_fetch_add_explicit(&ro->refs, 1, memory_order_relaxed);
+        pthread_mutex_unlock(&roster_mutex);
+        return ro;
+    }
+    pthread_mutex_unlock(&roster_mutex);
+
+    ro = roster_build();
+    if (!ro)
+    {
+        return NULL;
+    }
+    pthread_mutex_lock(&roster_mutex);
+    if (!roster || roster->gen < ro->gen)   //publish unless a racing /list got a newer one
+    {
+        roster_t *old = roster;
+        roster = ro;
+        atomic_fetch_add_explicit(&ro->refs, 1, memory_order_relaxed);
+        pthread_mutex_unlock(&roster_mutex);
+        if (old)
+        {
+            roster_put(old);
+        }
+        return ro;
+    }
+    pthread_mutex_unlock(&roster_mutex);
+    return ro;
+}
+
+//Drop a roster reference, the last one frees it
+void roster_put(roster_t *ro)
+{
+    if (atomic_fetch_sub_explicit(&ro->refs, 1, memory_order_acq_rel) == 1)
+    {
+        free(ro->offs);
+        free(ro);
+    }
+}
+
+//Stop writing to a client and wake its worker so it tears the connection down
+//called with out_lock held
+static void client_abort(client_t *cl)
+{
+    cl->closing = 1;
+    shutdown(cl->connfd, SHUT_RDWR);    //owning worker sees EPOLLHUP and closes
+}
+
+static int outq_push(client_t *cl, msg_t *m);
+
+//Queue a message for a client and write it right away if the socket allows
+//never blocks, a full queue is handled according to the overflow policy
+//the queue takes its own reference, the caller keeps theirs
+void client_send(client_t *cl, msg_t *m)
+{
+    if (pthread_mutex_trylock(&cl->out_lock) != 0)
+    {
+        unsigned long t0 = now_ns();        //only a contended lock is timed
+        pthread_mutex_lock(&cl->out_lock);
+        t0 = now_ns() - t0;
+        my_lock_ns += t0;
+        STAT_ADD(lock_wait_ns, t0);
+    }
+    if (outq_push(cl, m))
+    {
+        pthread_mutex_unlock(&cl->out_lock);
+        client_flush(cl);
+        return;
+    }
+    pthread_mutex_unlock(&cl->out_lock);
+}
+
+//Queue a message, as a frame for a binary client; returns 1 when the queue
+//was empty and wants a flush, called with out_lock held
+static int outq_push(client_t *cl, msg_t *m)
+{
+    if (cl->closing)
+    {
+        return 0;
+    }
+    if (cl->binary ? !(m = msg_frame(m)) : m->op == FRAME_RAW)
+    {
+        return 0;
+    }
+
+    if (cl->out_count == outq_limit)    //slow consumer
+    {
+        if (overflow == OVERFLOW_DISCONNECT)
+        {
+            LOG(LOG_WARN, "Client number [%d] disconnected: outbound queue full", cl->uid);
+            STAT_ADD(slow_kills, 1);
+            client_abort(cl);
+            return 0;
+        }
+
+        //messages handed to an io_uring writev belong to the kernel until it
+        //completes, drop the new one instead
+        if (cl->out_inflight)
+        {
+            STAT_ADD(dropped, 1);
+            return 0;
+        }
+
+        //drop the oldest message, but never one that is partially written
+        if (cl->out_off > 0)
+        {
+            //swap the partial head into the next slot so it survives the drop
+            int next = (cl->out_head + 1) % outq_limit;
+            msg_t *head = cl->outq[cl->out_head];
+            cl->outq[cl->out_head] = cl->outq[next];
+            cl->outq[next] = head;
+        }
+        msg_unref(cl->outq[cl->out_head]);
+        cl->out_head = (cl->out_head + 1) % outq_limit;
+        cl->out_count--;
+        STAT_ADD(dropped, 1);
+        STAT_ADD(dequeued, 1);
+    }
+
+    atomic_fetch_add_explicit(&m->refs, 1, memory_order_relaxed);
+    cl->outq[(cl->out_head + cl->out_count) % outq_limit] = m;
+    cl->out_count++;
+    STAT_ADD(enqueued, 1);
+    hist_add(&my_stats->queue_depth, cl->out_count);
+    if (cl->out_count == 1 && stall_ns)
+    {
+        cl->stall_mark = cl->out_total;     //the stall clock starts with the first waiting byte
+        cl->stall_ns = now_ns();
+    }
+    return cl->out_count == 1;  //queue was empty, socket is probably writable
+}
+
+//Account for n bytes written from the head of the outbound queue and release
+//every message that went out completely; returns the bytes written of the new
+//head, called with out_lock held
+size_t outq_advance(client_t *cl, size_t n)
+{
+    STAT_ADD(bytes_out, n);
+    cl->out_total += n;
+    n += cl->out_off;
+    while (cl->out_count > 0 && n >= cl->outq[cl->out_head]->len)
+    {
+        n -= cl->outq[cl->out_head]->len;
+        msg_unref(cl->outq[cl->out_head]);
+        cl->out_head = (cl->out_head + 1) % outq_limit;
+        cl->out_count--;
+        STAT_ADD(msgs_out, 1);
+        STAT_ADD(dequeued, 1);
+    }
+    cl->out_off = n;
+    return n;
+}
+
+//Write as much of the outbound queue as the socket accepts, one writev() per batch
+void client_flush(client_t *cl)
+{
+    struct iovec iov[IOV_BATCH];
+
+    pthread_mutex_lock(&cl->out_lock);
+    if (use_uring)
+    {
+        uring_flush(cl);        //submitted with the rest of the owning worker's batch
+        pthread_mutex_unlock(&cl->out_lock);
+        return;
+    }
+    while (cl->out_count > 0 && !cl->closing && !cl->out_inflight)
+    {
+        int cnt = cl->out_count < IOV_BATCH ? cl->out_count : IOV_BATCH;
+        for (int i = 0; i < cnt; i++)
+        {
+            msg_t *m = cl->outq[(cl->out_head + i) % outq_limit];
+            iov[i].iov_base = m->data;
+            iov[i].iov_len = m->len;
+        }
+        iov[0].iov_base = (char *)iov[0].iov_base + cl->out_off;
+        iov[0].iov_len -= cl->out_off;
+
+        ssize_t n = writev(cl->connfd, iov, cnt);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+            {
+                if (errno != EPIPE && errno != ECONNRESET)  //peer already gone
+                {
+                    LOG_ERRNO("Write to descriptor failed");
+                }
+                client_abort(cl);
+            }
+            break;              //wait for EPOLLOUT
+        }
+
+        if (outq_advance(cl, n) > 0)
+        {
+            break;              //short write, socket buffer is full
+        }
+    }
+    pthread_mutex_unlock(&cl->out_lock);
+}
+
+//Greet a newly accepted client, its join notice is broadcast by the worker
+void client_join(client_t *cl)
+{
+    message_self("> see /help for a list of commands\r\n>", cl);
+}
+
+//Drain a readable connection; edge triggered, so read until the socket would block
+void client_read(client_t *cl)
+{
+    ssize_t rlen;                       //read length
+
+    if (cl->throttle_ns)
+    {
+        return;             //paused by flood control, read again on resume
+    }
+    if (cl->reactor->ring)
+    {
+        uring_recv(cl->reactor, cl);
+        return;
+    }
+    while (1)
+    {
+        rlen = recv(cl->connfd, cl->inbuf + cl->inlen, sizeof(cl->inbuf) - 1 - cl->inlen, MSG_DONTWAIT);
+        if (rlen > 0)
+        {
+            capture(cl->reactor, cl->uid, CAPTURE_DATA, cl->inbuf + cl->inlen, rlen);
+            cl->inlen += rlen;
+            cl->last_in_ns = now_ns();
+            cl->pinged = 0;
+            STAT_ADD(bytes_in, rlen);
+            int ret = client_lines(cl);
+            if (ret < 0)
+            {
+                break;              //user wants to quit
+            }
+            if (ret > 0)
+            {
+                client_handoff(cl); //the worker owning its new room reads the rest
+                return;
+            }
+            if (cl->throttle_ns)
+            {
+                return;             //the rest stays in the socket, TCP slows the sender down
+            }
+            continue;
+        }
+        if (rlen < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            return;                 //nothing left to read
+        }
+        if (rlen < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        break;                      //peer closed or read error
+    }
+    client_close(cl);
+}
+
+//Pick up a connection flood control paused: handle the lines it kept, then
+//read what piled up in the socket, there is no new edge to report it
+void client_resume(client_t *cl)
+{
+    cl->throttle_ns = 0;
+    switch (client_lines(cl))
+    {
+    case -1:
+        client_close(cl);
+        return;
+    case 1:
+        client_handoff(cl);
+        return;
+    }
+    client_read(cl);
+}
+
+//A connection's timer fired: PING it once it has been idle for ping_ns and
+//cut it off when the answer is pong_ns late or its queued output went
+//stall_ns without a byte written, then schedule the next check. Output is
+//queued from any thread, so with an empty queue the stall check still comes
+//back every stall_ns; a stall is caught at most that late
+static void client_timer(reactor_t *r, client_t *cl)
+{
+    unsigned long now = now_ns(), next = ~0UL;
+
+    if (stall_ns)
+    {
+        pthread_mutex_lock(&cl->out_lock);
+        if (!cl->out_count)
+        {
+            cl->stall_mark = ~0UL;
+        }
+        else if (cl->stall_mark != cl->out_total)
+        {
+            cl->stall_mark = cl->out_total;     //waiting output, or progress since the last check
+            cl->stall_ns = now;
+        }
+        if (cl->stall_mark != ~0UL && now - cl->stall_ns >= stall_ns)
+        {
+            LOG(LOG_WARN, "Client [%d] stopped reading, disconnecting", cl->uid);
+            STAT_ADD(stall_kills, 1);
+            client_abort(cl);   //a recv may be in flight, the worker closes on its end
+            pthread_mutex_unlock(&cl->out_lock);
+            return;
+        }
+        next = (cl->stall_mark != ~0UL ? cl->stall_ns : now) + stall_ns;
+        pthread_mutex_unlock(&cl->out_lock);
+    }
+    if (ping_ns)
+    {
+        unsigned long idle_at = cl->last_in_ns + ping_ns;
+        if (cl->pinged && now >= idle_at + pong_ns)
+        {
+            LOG(LOG_WARN, "Client [%d] ping timeout, disconnecting", cl->uid);
+            STAT_ADD(ping_kills, 1);
+            pthread_mutex_lock(&cl->out_lock);
+            client_abort(cl);
+            pthread_mutex_unlock(&cl->out_lock);
+            return;
+        }
+        if (!cl->pinged && now >= idle_at)
+        {
+            cl->pinged = 1;
+            STAT_ADD(pings, 1);
+            message_self("PING\r\n", cl);
+        }
+        if (cl->pinged)
+        {
+            idle_at += pong_ns;
+        }
+        next = idle_at < next ? idle_at : next;
+    }
+    if (next != ~0UL && !cl->closing)
+    {
+        wheel_add(&r->wheel, &cl->timer, (next + TICK_NS - 1) / TICK_NS);
+    }
+}
+
+#define FLOOD_PAUSED 2      //flood_check(): client paused, the line waits
+
+//Charge n lines to the client's bucket, and to the room's as well when they
+//are chat, before anything is sent for them; a batch may run the buckets into
+//debt, later lines wait until it is paid off. Returns 0 when the lines may go
+//on, 1 when they are dropped, FLOOD_PAUSED when the client is paused and -1
+//when it is cut off
+static int flood_charge(client_t *cl, room_t *room, int n)
+{
+    unsigned long now = now_ns();
+    unsigned long wait = bucket_wait(&cl->flood, &client_limit, now);
+    if (room)
+    {
+        unsigned long room_wait = bucket_wait(&room->flood, &room_limit, now);
+        wait = room_wait > wait ? room_wait : wait;
+    }
+    if (!wait)
+    {
+        if (client_limit.rate > 0)
+        {
+            cl->flood.tokens -= n;
+        }
+        if (room && room_limit.rate > 0)
+        {
+            room->flood.tokens -= n;
+        }
+        return 0;
+    }
+
+    switch (flood)
+    {
+    case FLOOD_DELAY:
+        STAT_ADD(flood_delayed, 1);
+        reactor_throttle(cl->reactor, cl, now + wait);
+        return cl->throttle_ns ? FLOOD_PAUSED : 1;
+    case FLOOD_DROP:
+        STAT_ADD(flood_dropped, 1);
+        return 1;
+    default:
+        LOG(LOG_WARN, "Client number [%d] disconnected: flooding", cl->uid);
+        message_self("> disconnected for flooding\r\n", cl);
+        STAT_ADD(flood_kills, 1);
+        return -1;
+    }
+}
+
+//Charge one line, a chat line to its room as well; see flood_charge()
+static int flood_check(client_t *cl, const char *line)
+{
+    return flood_charge(cl, line[0] != '/' ? cl->room_ptr : NULL, 1);
+}
+
+//Handle one line, tagging the messages it sends with when it was read
+static int client_line(client_t *cl, char *line)
+{
+    my_line_ns = cl->last_in_ns;
+    my_line_uid = cl->uid;
+    int ret = handle_line(cl, line);
+    my_line_ns = 0;
+    return ret;
+}
+
+static int client_frames(client_t *cl);
+
+//Handle every complete line in the input buffer and keep the partial tail
+//for the next read; stops early and returns like handle_line
+int client_lines(client_t *cl)
+{
+    char *line = cl->inbuf;
+    char *end = cl->inbuf + cl->inlen;
+    char *nl;
+    int ret = 0;
+
+    int verdict = 0;
+
+    while (ret == 0 && !cl->binary && (nl = memchr(line, '\n', end - line)))
+    {
+        char *next = nl + 1;
+        if ((verdict = flood_check(cl, line)) == FLOOD_PAUSED)
+        {
+            break;              //the line waits in the buffer
+        }
+        if (nl > line && nl[-1] == '\r')
+        {
+            nl--;
+        }
+        *nl = '\0';             //terminate in place, handlers work on the buffer itself
+        STAT_ADD(lines_in, 1);
+        ret = verdict ? (verdict < 0 ? -1 : 0) : client_line(cl, line);
+        line = next;
+    }
+    if (ret == 0 && verdict != FLOOD_PAUSED && !cl->binary && line == cl->inbuf && cl->inlen == sizeof(cl->inbuf) - 1
+        && (verdict = flood_check(cl, line)) != FLOOD_PAUSED)
+    {
+        //full buffer and no newline: take it as one overlong line
+        *end = '\0';
+        STAT_ADD(lines_in, 1);
+        ret = verdict ? (verdict < 0 ? -1 : 0) : client_line(cl, line);
+        line = end;
+    }
+    cl->inlen = end - line;
+    memmove(cl->inbuf, line, cl->inlen);
+    return ret == 0 && cl->binary ? client_frames(cl) : ret;   //input after /binary is framed
+}
+
+//Check a frame's payload; returns how many messages it holds, -1 when it is
+//malformed. Texts may not hold a newline, text clients would see a forged line
+static int frame_count(int op, const char *body, const char *end)
+{
+    int n = 0;
+
+    if (op == FRAME_TEXT)
+    {
+        return memchr(body, '\n', end - body) ? -1 : 1;
+    }
+    if (op != FRAME_CHAT && op != FRAME_PRIV)
+    {
+        return -1;
+    }
+    while (body < end)
+    {
+        uint16_t len;
+        if (end - body < 2)
+        {
+            return -1;
+        }
+        memcpy(&len, body, 2);
+        len = ntohs(len);
+        body += 2;
+        if (end - body < len || memchr(body, '\n', len))
+        {
+            return -1;
+        }
+        body += len;
+        n++;
+    }
+    return n;
+}
+
+static void whisper(msg_t *m, int to);
+
+//Act on one checked frame from a binary client; returns like handle_line
+static int client_frame(client_t *cl, int op, int to, char *body, char *end)
+{
+    if (op == FRAME_TEXT)
+    {
+        char save = *end;       //the next frame starts there
+        *end = '\0';
+        int ret = handle_line(cl, body);
+        *end = save;
+        return ret;
+    }
+    while (body < end)
+    {
+        uint16_t len;
+        memcpy(&len, body, 2);
+        len = ntohs(len);
+        body += 2;
+        if (len && op == FRAME_CHAT)
+        {
+            msg_t *m = msg_say(FRAME_CHAT, cl, body, len);
+            relay_room(cl->room, m);
+            message(m, cl->uid, cl->room_ptr);
+        }
+        else if (len)
+        {
+            whisper(msg_say(FRAME_PRIV, cl, body, len), to);
+        }
+        body += len;
+    }
+    return 0;
+}
+
+//Handle every complete frame of a binary client and keep the partial tail;
+//stops early and returns like handle_line, a malformed frame cuts it off
+static int client_frames(client_t *cl)
+{
+    char *p = cl->inbuf;
+    char *end = cl->inbuf + cl->inlen;
+    int ret = 0;
+
+    my_line_ns = cl->last_in_ns;
+    my_line_uid = cl->uid;
+    while (ret == 0 && end - p >= FRAME_HDR)
+    {
+        uint32_t len, to;
+        memcpy(&len, p, 4);
+        len = ntohl(len);
+        memcpy(&to, p + 8, 4);
+        to = ntohl(to);
+        int op = (unsigned char)p[4];
+        char *body = p + FRAME_HDR + (unsigned char)p[5];
+        int n = -1;
+        if (len >= FRAME_HDR + (unsigned char)p[5] && len <= sizeof(cl->inbuf) - 1)
+        {
+            if ((size_t)(end - p) < len)
+            {
+                break;          //wait for the rest of the frame
+            }
+            n = frame_count(op, body, p + len);
+        }
+        if (n < 0)
+        {
+            LOG(LOG_WARN, "Client number [%d] disconnected: bad frame", cl->uid);
+            ret = -1;
+            break;
+        }
+        int verdict = flood_charge(cl, op == FRAME_CHAT ? cl->room_ptr : NULL, n);
+        if (verdict == FLOOD_PAUSED)
+        {
+            break;              //the frame waits in the buffer
+        }
+        STAT_ADD(lines_in, n);
+        ret = verdict ? (verdict < 0 ? -1 : 0) : client_frame(cl, op, to, body, p + len);
+        p += len;
+    }
+    my_line_ns = 0;
+    cl->inlen = end - p;
+    memmove(cl->inbuf, p, cl->inlen);
+    return ret;
+}
+
+//Split the next space separated word off *rest in place, NULL when none is left
+static char *next_token(char **rest)
+{
+    char *s = *rest;
+    while (*s == ' ')
+    {
+        s++;
+    }
+    if (!*s)
+    {
+        *rest = s;
+        return NULL;
+    }
+    char *tok = s;
+    while (*s && *s != ' ')
+    {
+        s++;
+    }
+    if (*s)
+    {
+        *s++ = '\0';
+    }
+    *rest = s;
+    return tok;
+}
+
+//Command handlers get the text after the command word and return like handle_line
+static int cmd_quit(client_t *my_client, char *args);
+static int cmd_test(client_t *my_client, char *args);
+static int cmd_room(client_t *my_client, char *args);
+static int cmd_nick(client_t *my_client, char *args);
+static int cmd_whisper(client_t *my_client, char *args);
+static int cmd_list(client_t *my_client, char *args);
+static int cmd_help(client_t *my_client, char *args);
+static int cmd_oper(client_t *my_client, char *args);
+static int cmd_stats(client_t *my_client, char *args);
+static int cmd_pong(client_t *my_client, char *args);
+static int cmd_binary(client_t *my_client, char *args);
+
+// Command table, /help is generated from it
+typedef struct {
+    const char *name;           // Command word including the '/'
+    int (*run)(client_t *my_client, char *args);    // Handler
+    const char *usage;          // Arguments shown by /help
+    const char *help;           // Description shown by /help
+} command_t;
+
+static const command_t commands[] = {
+    { "/quit",    cmd_quit,    "",                    "Quit chatroom" },
+    { "/test",    cmd_test,    "",                    "Server test" },
+    { "/room",    cmd_room,    "<room name>",         "Join or create a chat room" },
+    { "/nick",    cmd_nick,    "<name>",              "Change nickname" },
+    { "/whisper", cmd_whisper, "<user id> <message>", "Send private message" },
+    { "/list",    cmd_list,    "[page]",              "Show active clients" },
+    { "/help",    cmd_help,    "",                    "Show help" },
+    { "/oper",    cmd_oper,    "<password>",          "Log in as operator" },
+    { "/stats",   cmd_stats,   "",                    "Server counters (operators)" },
+    { "/pong",    cmd_pong,    "",                    "Answer a PING, any line does" },
+    { "/binary",  cmd_binary,  "",                    "Switch to binary frames, for bots" },
+};
+
+#define NCOMMANDS (sizeof(commands) / sizeof(commands[0]))
+#define COMMAND_BUCKETS 32      //power of two, well above NCOMMANDS
+
+static const command_t *command_index[COMMAND_BUCKETS];    //open addressing on the command word
+
+//Build the command index, once before any client connects
+void commands_init(void)
+{
+    for (unsigned int i = 0; i < NCOMMANDS; i++)
+    {
+        unsigned int b = name_hash(commands[i].name) & (COMMAND_BUCKETS - 1);
+        while (command_index[b])
+        {
+            b = (b + 1) & (COMMAND_BUCKETS - 1);
+        }
+        command_index[b] = &commands[i];
+    }
+}
+
+//Find a command by its word in O(1), NULL when unknown
+static const command_t *command_find(const char *name)
+{
+    unsigned int b = name_hash(name) & (COMMAND_BUCKETS - 1);
+    while (command_index[b])
+    {
+        if (!strcmp(command_index[b]->name, name))
+        {
+            return command_index[b];
+        }
+        b = (b + 1) & (COMMAND_BUCKETS - 1);
+    }
+    return NULL;
+}
+
+//Handle one client line, messaging or a "/" command; returns -1 when the client
+//quits and 1 when it has to be handed to another worker
+int handle_line(client_t *my_client, char *line)
+{
+    // Ignore input if empty
+    if (!*line)
+    {
+        return 0;
+    }
+
+    // "/" character read, check for command
+    if (line[0] == '/')
+    {
+        char *args = line;
+        const command_t *cmd = command_find(next_token(&args));
+        if (!cmd)
+        {
+            message_self("> unknown command\r\n", my_client);
+            return 0;
+        }
+        return cmd->run(my_client, args);
+    }
+
+    //user just wants to send a normal message
+    msg_t *m = msg_say(FRAME_CHAT, my_client, line, strlen(line));
+    relay_room(my_client ->room, m);
+    message(m, my_client ->uid, my_client ->room_ptr);
+    return 0;
+}
+
+//user wants to quit
+static int cmd_quit(client_t *my_client, char *args)
+{
+    return -1;
+}
+
+//answer to a PING, arriving was all it had to do
+static int cmd_pong(client_t *my_client, char *args)
+{
+    return 0;
+}
+
+//test server
+static int cmd_test(client_t *my_client, char *args)
+{
+    message_self("> *boop*\r\n> ", my_client);
+    return 0;
+}
+
+//change nickname
+static int cmd_nick(client_t *my_client, char *args)
+{
+    char old_name[sizeof(my_client ->name)];
+    char *param = next_token(&args);
+    if (!param)
+    {
+        message_self("> name cannot be empty\r\n", my_client);
+        return 0;
+    }
+    strcpy(old_name, my_client ->name);
+    pthread_rwlock_wrlock(&clients_lock);     //the roster builder reads names
+    snprintf(my_client ->name, sizeof(my_client ->name), "%s", param);
+    atomic_fetch_add(&roster_gen, 1);
+    relay_user(my_client);
+    pthread_rwlock_unlock(&clients_lock);
+    message_all(msg_printf("> user [%s] is now known as [%s]\r\n", old_name, my_client ->name));
+    return 0;
+}
+
+//change room, the room is created if nobody is in it yet
+static int cmd_room(client_t *my_client, char *args)
+{
+    char *param = next_token(&args);
+    if (!param || strlen(param) >= sizeof(my_client ->room))
+    {
+        message_self("> invalid room, names are 1 to 31 characters.\r\n", my_client);
+        return 0;
+    }
+    if (!strcmp(param, my_client ->room))
+    {
+        return 0;
+    }
+    room_leave(my_client);
+    pthread_rwlock_wrlock(&clients_lock);     //the roster builder reads room names
+    strcpy(my_client ->room, param);
+    atomic_fetch_add(&roster_gen, 1);
+    relay_user(my_client);
+    pthread_rwlock_unlock(&clients_lock);
+    //batched like join notices, a crowd changing rooms would otherwise cost a broadcast each
+    reactor_notice(my_client ->reactor, "> [%s] is now in room %s\r\n", my_client ->name, my_client ->room);
+    return client_move(my_client);      //join the room on the worker owning it
+}
+
+//send a private message to a select client
+static int cmd_whisper(client_t *my_client, char *args)
+{
+    char *param = next_token(&args);
+    while (*args == ' ')
+    {
+        args++;
+    }
+    if (!param || !*args)
+    {
+        message_self("> message cannot be null\r\n", my_client);
+        return 0;
+    }
+    whisper(msg_say(FRAME_PRIV, my_client, args, strlen(args)), atoi(param));
+    return 0;
+}
+
+//Deliver a whisper to a user of this or a linked server, consumes m
+static void whisper(msg_t *m, int to)
+{
+    if (to / UID_SPAN != node_id && relay_priv(to, m) == 0)
+    {
+        msg_unref(m);       //user of another server
+        return;
+    }
+    message_client(m, to);
+}
+
+//switch the connection to binary frames: the text ack is the last line the
+//client reads, a FRAME_HELLO follows it
+static int cmd_binary(client_t *my_client, char *args)
+{
+    msg_t *ack = msg_new("> binary\r\n", 10);
+    msg_t *hello = frame_new(FRAME_HELLO, my_client ->uid, my_client ->room, strlen(my_client ->room), "", 0);
+    int flush = 0;
+    if (ack && hello)
+    {
+        pthread_mutex_lock(&my_client ->out_lock);   //no other thread's message gets in between
+        flush = outq_push(my_client, ack);
+        my_client ->binary = 1;
+        flush |= outq_push(my_client, hello);
+        pthread_mutex_unlock(&my_client ->out_lock);
+    }
+    if (ack)
+    {
+        msg_unref(ack);
+    }
+    if (hello)
+    {
+        msg_unref(hello);
+    }
+    if (flush)
+    {
+        client_flush(my_client);
+    }
+    return 0;
+}
+
+//view all active client members and their room, one page of LIST_PAGE at a time
+//the page is copied out of a shared snapshot into a single message
+static int cmd_list(client_t *my_client, char *args)
+{
+    char *param = next_token(&args);
+    int page = param ? atoi(param) : 1;
+    roster_t *ro = roster_get();
+    if (!ro)
+    {
+        return 0;
+    }
+    int pages = ro->count ? (ro->count + LIST_PAGE - 1) / LIST_PAGE : 1;
+    if (page < 1 || page > pages)
+    {
+        message_self("> no such page\r\n", my_client);
+        roster_put(ro);
+        return 0;
+    }
+    unsigned int first = (page - 1) * LIST_PAGE;
+    unsigned int last = first + LIST_PAGE < ro->count ? first + LIST_PAGE : ro->count;
+    size_t body = ro->offs[last] - ro->offs[first];
+
+    char head[96];
+    const char foot[] = "=============================\r\n";
+    int hlen = snprintf(head, sizeof(head), "=============================\r\nClients in server: %u (page %d of %d)\r\n",
+                        ro->count, page, pages);
+    msg_t *m = (msg_t *)malloc(sizeof(msg_t) + hlen + body + sizeof(foot));
+    if (!m)
+    {
+        LOG_ERRNO("Cannot allocate memory");
+        roster_put(ro);
+        return 0;
+    }
+    msg_init(m, hlen + body + sizeof(foot) - 1);
+    memcpy(m->data, head, hlen);
+    memcpy(m->data + hlen, ro->text + ro->offs[first], body);
+    memcpy(m->data + hlen + body, foot, sizeof(foot));
+    roster_put(ro);
+
+    client_send(my_client, m);
+    msg_unref(m);
+    return 0;
+}
+
+//log in as operator
+static int cmd_oper(client_t *my_client, char *args)
+{
+    char *param = next_token(&args);
+    if (!oper_password || !param || strcmp(param, oper_password))
+    {
+        message_self("> permission denied\r\n", my_client);
+        return 0;
+    }
+    my_client ->oper = 1;
+    message_self("> you are now an operator\r\n", my_client);
+    return 0;
+}
+
+//dump the server counters, operators only
+static int cmd_stats(client_t *my_client, char *args)
+{
+    if (!my_client ->oper)
+    {
+        message_self("> permission denied\r\n", my_client);
+        return 0;
+    }
+    char *buff_out = (char *)malloc(STATS_SZ);
+    if (!buff_out)
+    {
+        LOG_ERRNO("Cannot allocate memory");
+        return 0;
+    }
+    msg_t *m = msg_new(buff_out, stats_format(buff_out, STATS_SZ, "\r\n"));
+    free(buff_out);
+    if (m)
+    {
+        client_send(my_client, m);
+        msg_unref(m);
+    }
+    return 0;
+}
+
+//display all commands
+static int cmd_help(client_t *my_client, char *args)
+{
+    char buff_out[BUFFER_SZ];
+    char text[64];
+    size_t len = 0;
+
+    len += snprintf(buff_out + len, sizeof(buff_out) - len, "===============================================================\r\n");
+    for (unsigned int i = 0; i < NCOMMANDS; i++)
+    {
+        snprintf(text, sizeof(text), "%s%s%s", commands[i].usage, *commands[i].usage ? " " : "", commands[i].help);
+        len += snprintf(buff_out + len, sizeof(buff_out) - len, ">  %-10s%-49s<\r\n", commands[i].name, text);
+    }
+    snprintf(buff_out + len, sizeof(buff_out) - len, "===============================================================\r\n> ");
+    message_self(buff_out, my_client);
+    return 0;
+}
+
+//Close a connection, announce it and free its resources
+void client_close(client_t *cl)
+{
+    //delete client from queue first so no whisper targets it
+    queue_delete(cl->uid);
+    reactor_forget(cl->reactor, cl);
+
+    reactor_notice(cl->reactor, "[%s] has left\r\n", cl->name);     //broadcast after this wakeup
+    capture(cl->reactor, cl->uid, CAPTURE_CLOSE, NULL, 0);
+    LOG(LOG_INFO, "Client number [%d] has left the chat", cl->uid);
+    STAT_ADD(closed, 1);
+
+    pthread_mutex_lock(&cl->out_lock);
+    if (cl->out_inflight || cl->flush_posted)
+    {
+        //a ring holds a writev for this descriptor, maybe not even submitted yet,
+        //or an inbox holds its flush; keep the number from being reused and let
+        //the last of them close and free
+        cl->closing = 1;
+        cl->free_pending = 1;
+        shutdown(cl->connfd, SHUT_RDWR);    //the writev fails instead of waiting for the peer
+        pthread_mutex_unlock(&cl->out_lock);
+        return;
+    }
+    pthread_mutex_unlock(&cl->out_lock);
+    close(cl->connfd);     //also removes it from the epoll set
+    client_free(cl);
+}
+
+//Release anything still queued for a client and return it to the pool
+void client_free(client_t *cl)
+{
+    for (int i = 0; i < cl->out_count; i++)
+    {
+        msg_unref(cl->outq[(cl->out_head + i) % outq_limit]);
+    }
+    STAT_ADD(dequeued, cl->out_count);
+    cl->out_count = 0;
+
+    pthread_mutex_lock(&pool_mutex);
+    cl->next_free = free_clients;
+    free_clients = cl;
+    pthread_mutex_unlock(&pool_mutex);
+}
+
+//Send a message with descriptors attached, -1 on error
+static int send_fds(int sock, struct iovec *iov, int iovcnt, const int *fds, int nfds)
+{
+    char control[CMSG_SPACE(MAX_ACCEPTORS * sizeof(int))];
+    struct msghdr mh;
+
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = iov;
+    mh.msg_iovlen = iovcnt;
+    if (nfds > 0)
+    {
+        mh.msg_control = control;
+        mh.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+        struct cmsghdr *cm = CMSG_FIRSTHDR(&mh);
+        cm->cmsg_level = SOL_SOCKET;
+        cm->cmsg_type = SCM_RIGHTS;
+        cm->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+        memcpy(CMSG_DATA(cm), fds, nfds * sizeof(int));
+    }
+    return sendmsg(sock, &mh, 0) < 0 ? -1 : 0;
+}
+
+//Receive a message and the descriptors attached to it, returns its length
+static ssize_t recv_fds(int sock, void *buf, size_t len, int *fds, int maxfds, int *nfds)
+{
+    char control[CMSG_SPACE(MAX_ACCEPTORS * sizeof(int))];
+    struct iovec iov = { buf, len };
+    struct msghdr mh;
+
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = control;
+    mh.msg_controllen = sizeof(control);
+    ssize_t n = recvmsg(sock, &mh, MSG_CMSG_CLOEXEC);
+    *nfds = 0;
+    for (struct cmsghdr *cm = CMSG_FIRSTHDR(&mh); n >= 0 && cm; cm = CMSG_NXTHDR(&mh, cm))
+    {
+        if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS)
+        {
+            int cnt = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            for (int i = 0; i < cnt; i++)
+            {
+                int fd;
+                memcpy(&fd, CMSG_DATA(cm) + i * sizeof(int), sizeof(int));
+                if (*nfds < maxfds)
+                {
+                    fds[(*nfds)++] = fd;
+                }
+                else
+                {
+                    close(fd);
+                }
+            }
+        }
+    }
+    return n;
+}
+
+//Listen for the next server version on a Unix socket, owner access only
+int upgrade_listen(const char *path)
+{
+    struct sockaddr_un addr;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path))
+    {
+        LOG(LOG_ERROR, "Upgrade socket path too long");
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+    {
+        LOG_ERRNO("Socket creation failed");
+        return -1;
+    }
+    unlink(path);       //left by the process we took over, or a crashed one
+    mode_t mask = umask(077);
+    int ret = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+    umask(mask);
+    if (ret < 0 || listen(fd, 1) < 0)
+    {
+        LOG_ERRNO("Upgrade socket failed");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+//Connect to the server listening on path and take over its listening
+//sockets; returns the control connection, -1 when nobody is there
+int takeover_begin(const char *path, int *listenfds, int *nlisten)
+{
+    struct sockaddr_un addr;
+    handoff_hdr_t hdr;
+    int nfds;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+    int ctl = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (ctl < 0 || connect(ctl, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+        if (ctl >= 0)
+        {
+            close(ctl);
+        }
+        return -1;      //first start
+    }
+
+    ssize_t n = recv_fds(ctl, &hdr, sizeof(hdr), listenfds, MAX_ACCEPTORS, &nfds);
+    if (n != sizeof(hdr) || hdr.magic != HANDOFF_MAGIC || nfds != hdr.nlisten || nfds < 1)
+    {
+        LOG(LOG_ERROR, "Bad handover from the running server");
+        exit(EXIT_FAILURE);
+    }
+    atomic_store(&uid, hdr.next_uid);
+    *nlisten = nfds;
+    LOG(LOG_INFO, "Taking over %d listening sockets", nfds);
+    return ctl;
+}
+
+//Receive every client of the previous process and post it to its worker;
+//returns once the old process is gone, -1 when the handover broke off
+int takeover_clients(int ctl)
+{
+    size_t cap = sizeof(handoff_t) + BUFFER_SZ + HANDOFF_OUT_MAX;
+    char *buf = (char *)malloc(cap);
+    struct sockaddr_in addr;
+    int fd, nfds, count = 0;
+
+    while (buf)
+    {
+        ssize_t n = recv_fds(ctl, buf, cap, &fd, 1, &nfds);
+        handoff_t rec;
+        if (n < (ssize_t)sizeof(rec))
+        {
+            LOG(LOG_ERROR, "Handover broke off after %d clients", count);
+            return -1;
+        }
+        memcpy(&rec, buf, sizeof(rec));
+        if (!rec.uid)
+        {
+            break;      //end of the handover
+        }
+        if (nfds != 1 || sizeof(rec) + rec.inlen + rec.outlen != (size_t)n)
+        {
+            LOG(LOG_ERROR, "Bad handover record");
+            continue;
+        }
+
+        addr = rec.addr;
+        client_t *cl = client_alloc(fd, &addr);
+        if (!cl)
+        {
+            close(fd);
+            continue;
+        }
+        atomic_fetch_sub(&uid, 1);      //keeps the id it had, the new one is handed out again
+        cl->uid = rec.uid;
+        cl->oper = rec.oper;
+        cl->binary = rec.binary;
+        snprintf(cl->name, sizeof(cl->name), "%s", rec.name);
+        snprintf(cl->room, sizeof(cl->room), "%s", rec.room);
+        cl->inlen = rec.inlen < sizeof(cl->inbuf) - 1 ? rec.inlen : sizeof(cl->inbuf) - 1;
+        memcpy(cl->inbuf, buf + sizeof(rec), cl->inlen);
+        if (rec.outlen)
+        {
+            //queued as is, the worker flushes it once the client is attached
+            msg_t *m = msg_new(buf + sizeof(rec) + rec.inlen, rec.outlen);
+            if (m)
+            {
+                cl->outq[0] = m;
+                cl->out_count = 1;
+                STAT_ADD(enqueued, 1);
+            }
+        }
+        cl->handoff.kind = rec.fresh ? TASK_NEW : TASK_RESTORE;
+        reactor_post(room_reactor(cl->room), &cl->handoff);
+        count++;
+    }
+    free(buf);
+
+    //the old process exits right after the last record, wait for it so its
+    //metrics port and control socket are free
+    char c;
+    while (recv(ctl, &c, 1, 0) > 0);
+    close(ctl);
+    LOG(LOG_INFO, "Took over %d clients", count);
+    return 0;
+}
+
+//Cancel everything a frozen worker's ring has in flight and apply what
+//completed meanwhile, so client_t holds all input and output state
+static void uring_settle(reactor_t *r)
+{
+    uring_t *u = r->ring;
+    int cancelled = 0;
+
+    struct io_uring_sqe *sqe = uring_sqe(u);
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_ANY;
+    sqe->user_data = URING_CANCEL;
+    uring_publish(u);
+    while (r->ring_ops > 0 || !cancelled)
+    {
+        uring_enter(u, 1, -1);
+        unsigned head = *u->cq_head;
+        unsigned tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++)
+        {
+            struct io_uring_cqe *cqe = &u->cqes[head & *u->cq_mask];
+            client_t *cl = (client_t *)(uintptr_t)(cqe->user_data & ~(uint64_t)(URING_TAGS - 1));
+            switch (cqe->user_data & (URING_TAGS - 1))
+            {
+            case URING_CANCEL:
+                cancelled = 1;
+                if (cqe->res < 0 && cqe->res != -ENOENT)    //ENOENT: all of them completed already
+                {
+                    LOG(LOG_ERROR, "io_uring cancel failed: %s", strerror(-cqe->res));
+                    r->ring_ops = 0;    //cannot wait for them, input in flight is lost
+                }
+                continue;
+            case URING_RECV:
+                if (cqe->res > 0)
+                {
+                    cl->inlen += cqe->res;
+                }
+                break;
+            case URING_SEND:
+                pthread_mutex_lock(&cl->out_lock);
+                cl->out_inflight = 0;
+                if (cqe->res > 0)
+                {
+                    outq_advance(cl, cqe->res);
+                }
+                pthread_mutex_unlock(&cl->out_lock);
+                if (cl->free_pending && !cl->flush_posted)
+                {
+                    close(cl->connfd);
+                    client_free(cl);
+                }
+                break;
+            }
+            if (r->ring_ops > 0)
+            {
+                r->ring_ops--;
+            }
+        }
+        __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+    }
+}
+
+//Stop a frozen acceptor's multishot accept; connections it took meanwhile
+//are returned in extra
+static void uring_settle_accept(acceptor_t *a, client_t ***extra, int *nextra, int *cap)
+{
+    uring_t *u = a->ring;
+    struct sockaddr_in cli_addr;
+    int cancelled = 0, accepting = 1;
+
+    struct io_uring_sqe *sqe = uring_sqe(u);
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_ANY;
+    sqe->user_data = URING_CANCEL;
+    uring_publish(u);
+    while (accepting || !cancelled)
+    {
+        uring_enter(u, 1, -1);
+        unsigned head = *u->cq_head;
+        unsigned tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++)
+        {
+            struct io_uring_cqe *cqe = &u->cqes[head & *u->cq_mask];
+            if (cqe->user_data == URING_CANCEL)
+            {
+                cancelled = 1;
+                accepting = accepting && cqe->res >= 0;
+                continue;
+            }
+            if (!(cqe->flags & IORING_CQE_F_MORE))
+            {
+                accepting = 0;
+            }
+            if (cqe->res < 0)
+            {
+                continue;
+            }
+            socklen_t clientlength = sizeof(cli_addr);
+            if (getpeername(cqe->res, (struct sockaddr*)&cli_addr, &clientlength) < 0)
+            {
+                memset(&cli_addr, 0, sizeof(cli_addr));
+            }
+            client_t *cl = client_alloc(cqe->res, &cli_addr);
+            if (*nextra == *cap)
+            {
+                *cap = *cap ? *cap * 2 : 64;
+                *extra = (client_t **)realloc(*extra, *cap * sizeof(client_t *));
+            }
+            if (!cl || !*extra)
+            {
+                close(cqe->res);
+                continue;
+            }
+            (*extra)[(*nextra)++] = cl;
+        }
+        __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+    }
+}
+
+//Copy the unsent output of a client, the rest of a partly written message
+//first; whole messages that do not fit in cap are left out
+static size_t outq_copy(client_t *cl, char *buf, size_t cap)
+{
+    size_t len = 0;
+    for (int i = 0; i < cl->out_count; i++)
+    {
+        msg_t *m = cl->outq[(cl->out_head + i) % outq_limit];
+        size_t off = i ? 0 : cl->out_off;
+        if (len + m->len - off > cap)
+        {
+            STAT_ADD(dropped, cl->out_count - i);
+            break;
+        }
+        memcpy(buf + len, m->data + off, m->len - off);
+        len += m->len - off;
+    }
+    return len;
+}
+
+//Pass one client and its socket to the new process
+static int handoff_client(int ctl, client_t *cl, int fresh, char *out)
+{
+    handoff_t rec;
+    struct iovec iov[3];
+
+    memset(&rec, 0, sizeof(rec));
+    rec.uid = cl->uid;
+    rec.oper = cl->oper;
+    rec.fresh = fresh;
+    rec.inlen = cl->inlen;
+    pthread_mutex_lock(&cl->out_lock);     //the relay thread may still be queueing
+    rec.binary = cl->binary;
+    rec.outlen = outq_copy(cl, out, HANDOFF_OUT_MAX);
+    pthread_mutex_unlock(&cl->out_lock);
+    memcpy(rec.name, cl->name, sizeof(rec.name));
+    memcpy(rec.room, cl->room, sizeof(rec.room));
+    rec.addr = cl->addr;
+    iov[0].iov_base = &rec;
+    iov[0].iov_len = sizeof(rec);
+    iov[1].iov_base = cl->inbuf;
+    iov[1].iov_len = cl->inlen;
+    iov[2].iov_base = out;
+    iov[2].iov_len = rec.outlen;
+    return send_fds(ctl, iov, 3, &cl->connfd, 1);
+}
+
+//Freeze every thread and hand the listening sockets and every client to the
+//new process on ctl, then exit; returns only if nothing was handed over yet
+static void upgrade_send(int ctl)
+{
+    client_t **extra = NULL;    //connections no worker has registered yet
+    int nextra = 0, extra_cap = 0;
+    int listenfds[MAX_ACCEPTORS];
+    handoff_hdr_t hdr;
+    struct iovec iov = { &hdr, sizeof(hdr) };
+    char *out = (char *)malloc(HANDOFF_OUT_MAX);
+
+    if (!out)
+    {
+        LOG_ERRNO("Cannot allocate memory");
+        return;
+    }
+    unsigned long t0 = now_ns();
+    pthread_rwlock_wrlock(&freeze_lock);        //every worker, acceptor and the relay is between wakeups now
+    LOG(LOG_INFO, "Handing over to a new process");
+
+    //settle the rings, then run what the workers were posted but did not get to
+    for (int i = 0; i < nacceptors; i++)
+    {
+        if (acceptors[i].ring)
+        {
+            uring_settle_accept(&acceptors[i], &extra, &nextra, &extra_cap);
+        }
+    }
+    for (int i = 0; i < nreactors; i++)
+    {
+        if (reactors[i].ring)
+        {
+            uring_settle(&reactors[i]);
+        }
+        capture_flush(&reactors[i], 1);     //the new process appends to the same file
+    }
+    for (int i = 0; i < nreactors; i++)
+    {
+        task_t *t;
+        while ((t = reactor_pop(&reactors[i])))
+        {
+            switch (t->kind)
+            {
+            case TASK_NEW:          //accepted, not announced yet
+                if (nextra == extra_cap)
+                {
+                    extra_cap = extra_cap ? extra_cap * 2 : 64;
+                    extra = (client_t **)realloc(extra, extra_cap * sizeof(client_t *));
+                }
+                if (extra)
+                {
+                    extra[nextra++] = t->cl;
+                }
+                break;
+            case TASK_BROADCAST:    //queued for the clients of that worker
+                reactor_deliver(&reactors[i], t->msg);
+                msg_unref(t->msg);
+                free(t);
+                break;
+            case TASK_ROOM:         //relayed line, the links do not survive the handover
+                msg_unref(t->msg);
+                free(t);
+                break;
+            case TASK_FLUSH:        //the output goes over with the client
+                t->cl->flush_posted = 0;
+                if (t->cl->free_pending && !t->cl->out_inflight)
+                {
+                    close(t->cl->connfd);
+                    client_free(t->cl);
+                }
+                break;
+            default:                //in the registry already
+                break;
+            }
+        }
+    }
+
+    hdr.magic = HANDOFF_MAGIC;
+    hdr.nlisten = nacceptors;
+    hdr.next_uid = atomic_load(&uid);
+    for (int i = 0; i < nacceptors; i++)
+    {
+        listenfds[i] = acceptors[i].listenfd;
+    }
+    if (send_fds(ctl, &iov, 1, listenfds, nacceptors) < 0)
+    {
+        //the rings are cancelled, this process cannot go on serving either
+        LOG_ERRNO("Handover failed");
+        exit(EXIT_FAILURE);
+    }
+
+    int sent = 0;
+    pthread_rwlock_rdlock(&clients_lock);
+    for (unsigned int i = 0; i < client_count; i++)
+    {
+        sent += handoff_client(ctl, clients[i], 0, out) == 0;
+    }
+    pthread_rwlock_unlock(&clients_lock);
+    for (int i = 0; i < nextra; i++)
+    {
+        sent += handoff_client(ctl, extra[i], 1, out) == 0;
+    }
+    handoff_t end;
+    memset(&end, 0, sizeof(end));
+    iov.iov_base = &end;
+    iov.iov_len = sizeof(end);
+    send_fds(ctl, &iov, 1, NULL, 0);
+    LOG(LOG_INFO, "Handed over %d clients in %lu ms, exiting", sent, (now_ns() - t0) / 1000000);
+    exit(EXIT_SUCCESS);     //the new process holds every socket now
+}
+
+//Upgrade thread: wait for a new server process on the control socket
+void *upgrade_loop(void *arg)
+{
+    int listenfd = *(int *)arg;
+
+    log_thread("upgrade");
+    while (1)
+    {
+        int ctl = accept4(listenfd, NULL, NULL, SOCK_CLOEXEC);
+        if (ctl < 0)
+        {
+            continue;
+        }
+        upgrade_send(ctl);
+        close(ctl);
+    }
+    return NULL;
+}
+
+//Queue bytes for a peer, the relay thread writes them; called with relay_lock
+//held so the link stays up meanwhile
+static void link_queue(link_t *l, const char *hdr, size_t hlen, const char *data, size_t len)
+{
+    pthread_mutex_lock(&l->lock);
+    if (l->broken)
+    {
+        pthread_mutex_unlock(&l->lock);
+        return;
+    }
+    int was_idle = !l->out_len;
+    if (l->out_len + hlen + len > l->out_cap)
+    {
+        size_t cap = (l->out_len + hlen + len) * 2;
+        char *out = cap <= LINK_BUF_MAX ? (char *)realloc(l->out, cap) : NULL;
+        if (!out)
+        {
+            l->broken = 1;      //peer cannot keep up, better resync than lose lines silently
+            pthread_mutex_unlock(&l->lock);
+            uint64_t one = 1;
+            if (write(relay_wakefd, &one, sizeof(one)) < 0)
+            {
+                LOG_ERRNO("eventfd write failed");
+            }
+            return;
+        }
+        l->out = out;
+        l->out_cap = cap;
+    }
+    memcpy(l->out + l->out_len, hdr, hlen);
+    memcpy(l->out + l->out_len + hlen, data, len);
+    l->out_len += hlen + len;
+    pthread_mutex_unlock(&l->lock);
+    if (was_idle)
+    {
+        uint64_t one = 1;
+        if (write(relay_wakefd, &one, sizeof(one)) < 0)
+        {
+            LOG_ERRNO("eventfd write failed");
+        }
+    }
+}
+
+//Announce a user of this server or its new name or room to every peer,
+//called with clients_lock held for writing so peers see changes in order
+void relay_user(client_t *cl)
+{
+    char hdr[64 + ROOM_NAME_SZ];
+
+    if (!nlinks)
+    {
+        return;
+    }
+    int hlen = snprintf(hdr, sizeof(hdr), "USER %d %s %s\n", cl->uid, cl->room, cl->name);
+    pthread_rwlock_rdlock(&relay_lock);
+    for (int i = 0; i < nlinks; i++)
+    {
+        if (links[i].node)
+        {
+            link_queue(&links[i], hdr, hlen, "", 0);
+        }
+    }
+    pthread_rwlock_unlock(&relay_lock);
+}
+
+//Tell every peer a user of this server left, called with clients_lock held
+void relay_quit(int uid)
+{
+    char hdr[32];
+
+    if (!nlinks)
+    {
+        return;
+    }
+    int hlen = snprintf(hdr, sizeof(hdr), "QUIT %d\n", uid);
+    pthread_rwlock_rdlock(&relay_lock);
+    for (int i = 0; i < nlinks; i++)
+    {
+        if (links[i].node)
+        {
+            link_queue(&links[i], hdr, hlen, "", 0);
+        }
+    }
+    pthread_rwlock_unlock(&relay_lock);
+}
+
+//Find a room with members on other servers, called with relay_lock held
+static remote_room_t *remote_room_find(const char *name, unsigned int hash)
+{
+    remote_room_t *rr = remote_rooms[hash & (REMOTE_ROOM_BUCKETS - 1)];
+    while (rr && (rr->hash != hash || strcmp(rr->name, name)))
+    {
+        rr = rr->next;
+    }
+    return rr;
+}
+
+//Relay a line said in a room of this server to the peers with members in it
+void relay_room(const char *room, msg_t *m)
+{
+    char hdr[32 + ROOM_NAME_SZ];
+
+    if (!nlinks || !m)
+    {
+        return;
+    }
+    unsigned int hash = name_hash(room);
+    pthread_rwlock_rdlock(&relay_lock);
+    remote_room_t *rr = remote_room_find(room, hash);
+    if (rr)
+    {
+        int hlen = snprintf(hdr, sizeof(hdr), "ROOM %s %zu\n", room, m->len);
+        for (int i = 0; i < nlinks; i++)
+        {
+            if (rr->members[i] && links[i].node)
+            {
+                link_queue(&links[i], hdr, hlen, m->data, m->len);
+            }
+        }
+    }
+    pthread_rwlock_unlock(&relay_lock);
+}
+
+//Relay a line for everyone to every peer
+void relay_all(msg_t *m)
+{
+    char hdr[32];
+
+    if (!nlinks)
+    {
+        return;
+    }
+    int hlen = snprintf(hdr, sizeof(hdr), "ALL %zu\n", m->len);
+    pthread_rwlock_rdlock(&relay_lock);
+    for (int i = 0; i < nlinks; i++)
+    {
+        if (links[i].node)
+        {
+            link_queue(&links[i], hdr, hlen, m->data, m->len);
+        }
+    }
+    pthread_rwlock_unlock(&relay_lock);
+}
+
+//Relay a whisper to the server a user is on, -1 when no peer has that user
+int relay_priv(int uid, msg_t *m)
+{
+    char hdr[48];
+    int ret = -1;
+
+    if (!nlinks || !m)
+    {
+        return -1;
+    }
+    pthread_rwlock_rdlock(&relay_lock);
+    remote_t *u = remotes[(unsigned int)uid & (REMOTE_BUCKETS - 1)];
+    while (u && u->uid != uid)
+    {
+        u = u->next;
+    }
+    if (u && links[u->link].node)
+    {
+        int hlen = snprintf(hdr, sizeof(hdr), "PRIV %d %zu\n", uid, m->len);
+        link_queue(&links[u->link], hdr, hlen, m->data, m->len);
+        ret = 0;
+    }
+    pthread_rwlock_unlock(&relay_lock);
+    return ret;
+}
+
+//Count a remote user in or out of its room, called with relay_lock held for writing
+static void remote_room_count(remote_t *u, int delta)
+{
+    unsigned int hash = name_hash(u->room);
+    remote_room_t *rr = remote_room_find(u->room, hash);
+
+    if (!rr)
+    {
+        if (delta < 0 || !(rr = (remote_room_t *)calloc(1, sizeof(remote_room_t))))
+        {
+            return;
+        }
+        snprintf(rr->name, sizeof(rr->name), "%s", u->room);
+        rr->hash = hash;
+        rr->next = remote_rooms[hash & (REMOTE_ROOM_BUCKETS - 1)];
+        remote_rooms[hash & (REMOTE_ROOM_BUCKETS - 1)] = rr;
+    }
+    rr->members[u->link] += delta;
+    rr->total += delta;
+    if (!rr->total)
+    {
+        remote_room_t **link = &remote_rooms[hash & (REMOTE_ROOM_BUCKETS - 1)];
+        while (*link != rr)
+        {
+            link = &(*link)->next;
+        }
+        *link = rr->next;
+        free(rr);
+    }
+}
+
+//A peer announced a user or changed one
+static void remote_update(int link, int uid, const char *room, const char *name)
+{
+    pthread_rwlock_wrlock(&relay_lock);
+    remote_t **chain = &remotes[(unsigned int)uid & (REMOTE_BUCKETS - 1)];
+    remote_t *u = *chain;
+    while (u && u->uid != uid)
+    {
+        u = u->next;
+    }
+    if (u)
+    {
+        remote_room_count(u, -1);
+    }
+    else if ((u = (remote_t *)malloc(sizeof(remote_t))))
+    {
+        u->uid = uid;
+        u->next = *chain;
+        *chain = u;
+        remote_count++;
+    }
+    if (u)
+    {
+        u->link = link;
+        snprintf(u->name, sizeof(u->name), "%s", name);
+        snprintf(u->room, sizeof(u->room), "%s", room);
+        remote_room_count(u, 1);
+        atomic_fetch_add(&roster_gen, 1);
+    }
+    pthread_rwlock_unlock(&relay_lock);
+}
+
+//Forget a user of another server, called with relay_lock held for writing
+static void remote_remove(remote_t **chain)
+{
+    remote_t *u = *chain;
+    *chain = u->next;
+    remote_room_count(u, -1);
+    remote_count--;
+    free(u);
+    atomic_fetch_add(&roster_gen, 1);
+}
+
+//Set up the link slots and the relay wakeup, before any client connects
+int relay_init(void)
+{
+    remotes = (remote_t **)calloc(REMOTE_BUCKETS, sizeof(remote_t *));
+    remote_rooms = (remote_room_t **)calloc(REMOTE_ROOM_BUCKETS, sizeof(remote_room_t *));
+    relay_wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (!remotes || !remote_rooms || relay_wakefd < 0)
+    {
+        LOG_ERRNO("Relay setup failed");
+        return -1;
+    }
+    for (int i = 0; i < MAX_LINKS; i++)
+    {
+        links[i].fd = -1;
+        links[i].peer = i < nlink_peers ? link_peers[i] : NULL;
+        pthread_mutex_init(&links[i].lock, NULL);
+    }
+    nlinks = link_port ? MAX_LINKS : nlink_peers;   //accepted links take the free slots
+    return 0;
+}
+
+//Take a link down: its users vanish from this server and a dialled one is
+//dialled again later
+static void link_down(link_t *l, const char *why)
+{
+    int idx = l - links;
+
+    if (l->node)
+    {
+        LOG(LOG_WARN, "Link to node %d down: %s", l->node, why);
+    }
+    pthread_rwlock_wrlock(&relay_lock);
+    for (unsigned int i = 0; remote_count && i < REMOTE_BUCKETS; i++)
+    {
+        remote_t **chain = &remotes[i];
+        while (*chain)
+        {
+            if ((*chain)->link == idx)
+            {
+                remote_remove(chain);
+            }
+            else
+            {
+                chain = &(*chain)->next;
+            }
+        }
+    }
+    l->node = 0;
+    pthread_rwlock_unlock(&relay_lock);
+
+    pthread_mutex_lock(&l->lock);
+    l->out_len = 0;
+    l->broken = 0;
+    pthread_mutex_unlock(&l->lock);
+    l->in_len = 0;
+    close(l->fd);
+    l->fd = -1;
+    l->connecting = 0;
+    l->retry_ns = now_ns() + LINK_RETRY_MS * 1000000UL;
+}
+
+//Start dialling an outgoing link, the handshake follows once it connects
+static void link_dial(link_t *l)
+{
+    char host[256];
+    struct addrinfo hints, *res;
+
+    l->retry_ns = now_ns() + LINK_RETRY_MS * 1000000UL;
+    snprintf(host, sizeof(host), "%s", l->peer);
+    char *port = strrchr(host, ':');
+    if (!port)
+    {
+        LOG(LOG_ERROR, "Link %s: expected host:port", l->peer);
+        l->retry_ns = ~0UL;
+        return;
+    }
+    *port++ = '\0';
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, port, &hints, &res) != 0)
+    {
+        return;
+    }
+    l->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (l->fd >= 0 && connect(l->fd, res->ai_addr, res->ai_addrlen) < 0 && errno != EINPROGRESS)
+    {
+        close(l->fd);
+        l->fd = -1;
+    }
+    freeaddrinfo(res);
+    l->connecting = l->fd >= 0;
+}
+
+//Introduce this server, the peer answers with its own NODE line
+static void link_hello(link_t *l)
+{
+    char hdr[32 + LINK_SECRET_SZ];
+    int one = 1;
+
+    setsockopt(l->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    int hlen = snprintf(hdr, sizeof(hdr), "NODE %d%s%s\n", node_id, link_secret ? " " : "",
+                        link_secret ? link_secret : "");
+    link_queue(l, hdr, hlen, "", 0);
+}
+
+//Whether the secret of a peer's NODE line, zero padded, is ours; compared in
+//full so the time taken tells nothing. Any peer will do when there is none
+static int link_trusted(const char given[LINK_SECRET_SZ])
+{
+    char want[LINK_SECRET_SZ] = "";
+    unsigned char diff = 0;
+
+    if (!link_secret)
+    {
+        return 1;
+    }
+    memcpy(want, link_secret, strlen(link_secret));
+    for (size_t i = 0; i < LINK_SECRET_SZ; i++)
+    {
+        diff |= want[i] ^ given[i];
+    }
+    return !diff;
+}
+
+//The peer introduced itself: send it every user of this server and start
+//relaying; clients_lock keeps the registry still until the link is up, so no
+//change falls between the burst and the first relay_user()
+static int link_up(link_t *l, int node)
+{
+    char hdr[64 + ROOM_NAME_SZ];
+
+    if (node < 1 || node == node_id)
+    {
+        return -1;
+    }
+    pthread_rwlock_rdlock(&clients_lock);
+    pthread_rwlock_wrlock(&relay_lock);
+    for (int i = 0; i < nlinks; i++)
+    {
+        if (links[i].node == node)
+        {
+            pthread_rwlock_unlock(&relay_lock);
+            pthread_rwlock_unlock(&clients_lock);
+            return -1;      //linked already, the mesh needs each pair once
+        }
+    }
+    for (unsigned int i = 0; i < client_count; i++)
+    {
+        int hlen = snprintf(hdr, sizeof(hdr), "USER %d %s %s\n", clients[i]->uid, clients[i]->room, clients[i]->name);
+        link_queue(l, hdr, hlen, "", 0);
+    }
+    l->node = node;
+    pthread_rwlock_unlock(&relay_lock);
+    pthread_rwlock_unlock(&clients_lock);
+    LOG(LOG_INFO, "Linked to node %d, %u users sent", node, client_count);
+    return 0;
+}
+
+//Hand a relayed line to the worker owning its room
+static void relay_deliver_room(const char *room, msg_t *m)
+{
+    room_task_t *t = (room_task_t *)malloc(sizeof(room_task_t));
+    if (!t)
+    {
+        LOG_ERRNO("Cannot allocate memory");
+        msg_unref(m);
+        return;
+    }
+    snprintf(t->room, sizeof(t->room), "%s", room);
+    t->task.kind = TASK_ROOM;
+    t->task.cl = NULL;
+    t->task.msg = m;
+    reactor_post(room_reactor(t->room), &t->task);
+}
+
+//Handle what a peer sent, whole lines and payloads only; -1 drops the link
+static int link_input(link_t *l)
+{
+    char *p = l->in, *end = l->in + l->in_len;
+    char *nl;
+
+    while ((nl = memchr(p, '\n', end - p)))
+    {
+        char word[8], a[ROOM_NAME_SZ], b[32];
+        int num;
+        size_t len = 0;
+        *nl = '\0';
+        if (sscanf(p, "%7s", word) != 1)
+        {
+            return -1;
+        }
+        if (!strcmp(word, "NODE"))
+        {
+            char secret[LINK_SECRET_SZ] = "";
+            if (l->node || sscanf(p, "NODE %d %127s", &num, secret) < 1)    //LINK_SECRET_SZ - 1
+            {
+                return -1;
+            }
+            if (!link_trusted(secret))
+            {
+                LOG(LOG_WARN, "Link from node %d refused, wrong secret", num);
+                return -1;
+            }
+            if (!l->peer)
+            {
+                link_hello(l);  //an accepted link answers only once the peer proved itself
+            }
+            if (link_up(l, num) < 0)
+            {
+                return -1;
+            }
+        }
+        else if (!l->node)
+        {
+            return -1;      //nothing before the handshake
+        }
+        else if (!strcmp(word, "USER"))
+        {
+            if (sscanf(p, "USER %d %31s %31s", &num, a, b) != 3)
+            {
+                return -1;
+            }
+            remote_update(l - links, num, a, b);
+        }
+        else if (!strcmp(word, "QUIT"))
+        {
+            if (sscanf(p, "QUIT %d", &num) != 1)
+            {
+                return -1;
+            }
+            pthread_rwlock_wrlock(&relay_lock);
+            remote_t **chain = &remotes[(unsigned int)num & (REMOTE_BUCKETS - 1)];
+            while (*chain && (*chain)->uid != num)
+            {
+                chain = &(*chain)->next;
+            }
+            if (*chain)
+            {
+                remote_remove(chain);
+            }
+            pthread_rwlock_unlock(&relay_lock);
+        }
+        else if ((!strcmp(word, "ROOM") && sscanf(p, "ROOM %31s %zu", a, &len) == 2) ||
+                 (!strcmp(word, "ALL") && sscanf(p, "ALL %zu", &len) == 1) ||
+                 (!strcmp(word, "PRIV") && sscanf(p, "PRIV %d %zu", &num, &len) == 2))
+        {
+            if (len > LINK_BUF_MAX)
+            {
+                return -1;
+            }
+            if ((size_t)(end - nl - 1) < len)
+            {
+                *nl = '\n';
+                break;          //payload still arriving
+            }
+            msg_t *m = msg_new(nl + 1, len);
+            nl += len;
+            if (m && word[0] == 'R')
+            {
+                relay_deliver_room(a, m);
+            }
+            else if (m && word[0] == 'A')
+            {
+                message_local(m);
+            }
+            else if (m)
+            {
+                message_client(m, num);
+            }
+        }
+        else
+        {
+            return -1;
+        }
+        p = nl + 1;
+    }
+    l->in_len = end - p;
+    memmove(l->in, p, l->in_len);
+    return 0;
+}
+
+//Read what a peer sent, -1 when the link is gone
+static int link_read(link_t *l)
+{
+    while (1)
+    {
+        if (l->in_len == l->in_cap)
+        {
+            size_t cap = l->in_cap ? l->in_cap * 2 : 65536;
+            char *in = cap <= LINK_BUF_MAX ? (char *)realloc(l->in, cap) : NULL;
+            if (!in)
+            {
+                return -1;
+            }
+            l->in = in;
+            l->in_cap = cap;
+        }
+        ssize_t n = recv(l->fd, l->in + l->in_len, l->in_cap - l->in_len, MSG_DONTWAIT);
+        if (n > 0)
+        {
+            l->in_len += n;
+            if (link_input(l) < 0)
+            {
+                return -1;
+            }
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        {
+            return 0;
+        }
+        return -1;
+    }
+}
+
+//Write what is queued for a peer, -1 when the link is gone
+static int link_write(link_t *l)
+{
+    pthread_mutex_lock(&l->lock);
+    int ret = l->broken ? -1 : 0;
+    if (!ret && l->out_len)
+    {
+        ssize_t n = send(l->fd, l->out, l->out_len, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n > 0)
+        {
+            l->out_len -= n;
+            memmove(l->out, l->out + n, l->out_len);
+        }
+        else if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+        {
+            ret = -1;
+        }
+    }
+    pthread_mutex_unlock(&l->lock);
+    return ret;
+}
+
+//Relay thread: dial, accept and serve the links to the other servers
+void *relay_loop(void *arg)
+{
+    int listenfd = *(int *)arg;
+    struct pollfd pfd[MAX_LINKS + 2];
+
+    log_thread("relay");
+    while (1)
+    {
+        unsigned long now = now_ns();
+        for (int i = 0; i < nlinks; i++)
+        {
+            if (links[i].peer && links[i].fd < 0 && now >= links[i].retry_ns)
+            {
+                link_dial(&links[i]);
+            }
+        }
+
+        int n = 0;
+        pfd[n].fd = relay_wakefd;
+        pfd[n++].events = POLLIN;
+        pfd[n].fd = listenfd;
+        pfd[n++].events = POLLIN;
+        for (int i = 0; i < nlinks; i++)
+        {
+            link_t *l = &links[i];
+            pthread_mutex_lock(&l->lock);
+            pfd[n].fd = l->fd;
+            pfd[n++].events = l->connecting ? POLLOUT : POLLIN | (l->out_len || l->broken ? POLLOUT : 0);
+            pthread_mutex_unlock(&l->lock);
+        }
+        if (poll(pfd, n, LINK_RETRY_MS) < 0)
+        {
+            continue;
+        }
+
+        pthread_rwlock_rdlock(&freeze_lock);    //a hot restart waits for the links to settle
+        uint64_t val;
+        if (pfd[0].revents && read(relay_wakefd, &val, sizeof(val)) < 0 && errno != EAGAIN)
+        {
+            LOG_ERRNO("eventfd read failed");
+        }
+        if (pfd[1].revents & POLLIN)
+        {
+            int fd = accept4(listenfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            int i = nlink_peers;
+            while (fd >= 0 && i < nlinks && links[i].fd >= 0)
+            {
+                i++;
+            }
+            if (fd >= 0 && i == nlinks)
+            {
+                close(fd);      //every slot taken
+            }
+            else if (fd >= 0)
+            {
+                links[i].fd = fd;   //silent until the peer's NODE line carries the secret
+            }
+        }
+        for (int i = 0; i < nlinks; i++)
+        {
+            link_t *l = &links[i];
+            short ev = pfd[i + 2].revents;
+            if (l->fd < 0 || pfd[i + 2].fd != l->fd || !ev)
+            {
+                continue;
+            }
+            if (l->connecting)
+            {
+                int err = 0;
+                socklen_t len = sizeof(err);
+                getsockopt(l->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+                if (err)
+                {
+                    link_down(l, strerror(err));
+                    continue;
+                }
+                l->connecting = 0;
+                link_hello(l);
+                continue;
+            }
+            if ((ev & (POLLIN | POLLHUP | POLLERR)) && link_read(l) < 0)
+            {
+                link_down(l, "closed");
+                continue;
+            }
+            if ((ev & POLLOUT) && link_write(l) < 0)
+            {
+                link_down(l, "cannot keep up");
+            }
+        }
+        pthread_rwlock_unlock(&freeze_lock);
+    }
+    return NULL;
+}
@@ -0,0 +1,1182 @@
+#define _GNU_SOURCE
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <stdint.h>
+#include <fcntl.h>
+
+// Load generator for the irc server.
+// reconnect: open every connection at once, wait until the server has
+// greeted each one, drop them all and do it again, like clients coming
+// back after a server restart. Reports accepted connections per second.
+// chat: spread the connections over a number of rooms and have each one
+// talk at a fixed rate. Every line carries its send time, so besides chat
+// lines delivered per second it reports the fan-out latency percentiles.
+// stall: one connection never reads while the others talk in its room at
+// -m lines/s each for -d seconds; passes when the server cuts the stalled
+// reader off, so run it against a server with a write stall timeout (-s)
+// well below that.
+// replay: reconnect every session of a capture the server recorded with -R
+// and send its input again, at the recorded pace sped up -x times, or as
+// fast as possible with -x 0, where sessions stay connected until the end.
+// Chat lines and whispers received are matched to the sends they came from
+// for the same latency percentiles; -o saves the results and -B prints the
+// change against results saved by an earlier run, say of the previous build.
+// Whispers name their target by uid and are replayed as captured, so they
+// only reach the same sessions on a freshly started server, which hands out
+// the same uids in connect order; replay warns when join notices show uids
+// the capture does not have.
+
+#define MAX_EVENTS 256
+#define WAVE_TIMEOUT_MS 30000           //give up on a wave after this long
+#define TICK_MS 10                      //chat send granularity
+#define QUIET_MS 300                    //silence that ends the room change notices
+#define SETTLE_MS 30000                 //give up waiting for that silence after this long
+#define LINE_SZ 256                     //longest server line we parse, longer ones are skipped
+#define STALL_RCVBUF 4096                //receive buffer of the reader that never reads
+#define SENT_BUCKETS 65536              //remembered replayed lines, power of two
+#define MATCH_MS 5000                   //older matches are scrollback replayed on a room change
+#define CAPTURE_MAGIC "IRCCAP1\n"       //first bytes of a capture file, see irc.c
+
+// Simulated connection
+typedef struct {
+    int fd;                     // Socket, -1 when closed
+    int welcomed;               // Server sent us something, so it accepted and adopted us
+    long sent;                  // Chat lines sent
+    char line[LINE_SZ];         // Partial line received
+    int linelen;                // Bytes in line, -1 while skipping an overlong one
+    char out[LINE_SZ];          // Tail of a line the socket did not take yet
+    int outlen;                 // Bytes in out, no more lines are sent while it has any
+} conn_t;
+
+// Chat measurements
+typedef struct {
+    long delivered;             // Chat lines received
+    unsigned int *lat;          // Send to receive latency of each line, microseconds
+    size_t nlat;                // Samples in lat
+    size_t cap;                 // Allocated samples
+} stats_t;
+
+// Capture record as irc.c writes it, followed by len bytes of input
+typedef struct {
+    uint64_t ns;                // Since the capture started
+    uint32_t uid;               // Connection
+    uint16_t kind;              // CAPTURE_OPEN, CAPTURE_DATA or CAPTURE_CLOSE
+    uint16_t len;               // Bytes of input that follow
+} capture_rec_t;
+
+enum { CAPTURE_OPEN, CAPTURE_DATA, CAPTURE_CLOSE };
+
+// Capture record loaded for replay
+typedef struct {
+    uint64_t ns;                // Since the capture started
+    int seq;                    // Position in the file, keeps sorting stable
+    int session;                // Index in the sessions
+    int kind;                   // CAPTURE_*
+    int len;                    // Bytes of input
+    const char *data;           // Input, inside the loaded file
+} replay_rec_t;
+
+// Replayed session
+typedef struct {
+    conn_t c;                   // Connection, c.fd -1 before it opens or after it closes
+    int closing;                // Close once out is sent
+    int binary;                 // Switched to binary frames, lines are no longer matched
+    char *out;                  // Input not sent yet
+    size_t outlen;              // Bytes in out
+    size_t outcap;              // Bytes allocated for out
+    char sent[LINE_SZ];         // Partial line sent
+    int sentlen;                // Bytes in sent, -1 while skipping an overlong one
+} session_t;
+
+static struct sockaddr_in server;
+static uint64_t sent_hash[SENT_BUCKETS];        //text of replayed lines, by hash
+static long long sent_us[SENT_BUCKETS];         //when each was last sent
+static const uint32_t *capture_uids;            //uids of the captured sessions, sorted
+static int capture_nuids;                       //entries in capture_uids
+static long whispers_sent;                      //replayed whispers, their targets are captured uids
+static unsigned int foreign_uid;                //first joined uid the capture does not have, 0 if none
+
+//milliseconds since an arbitrary point
+static double now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+//microseconds since an arbitrary point, shared by every connection
+static long long now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+//start a non-blocking connect, returns the socket or -1
+static int open_conn(void)
+{
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (fd < 0)
+    {
+        perror("socket");
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr *)&server, sizeof(server)) < 0 && errno != EINPROGRESS)
+    {
+        perror("connect");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+//count a delivered line with its latency in microseconds
+static void lat_add(stats_t *st, long long us)
+{
+    st->delivered++;
+    if (st->nlat == st->cap)
+    {
+        size_t cap = st->cap ? st->cap * 2 : 1 << 16;
+        unsigned int *lat = realloc(st->lat, cap * sizeof(unsigned int));
+        if (!lat)
+        {
+            return;
+        }
+        st->lat = lat;
+        st->cap = cap;
+    }
+    st->lat[st->nlat++] = us;
+}
+
+//count a received chat line and record its latency if it is one of ours
+static void chat_line(stats_t *st, const char *line, long long now)
+{
+    const char *p = strstr(line, "] bench ");
+    int from;
+    long seq;
+    long long sent;
+
+    if (!p || sscanf(p + 8, "%d %ld %lld", &from, &seq, &sent) != 3)
+    {
+        return;                 //notices and the like
+    }
+    lat_add(st, now - sent);
+}
+
+//split received bytes into lines and hand them to chat_line
+static void chat_input(conn_t *c, stats_t *st, const char *buf, ssize_t n)
+{
+    long long now = now_us();
+
+    for (ssize_t i = 0; i < n; i++)
+    {
+        if (buf[i] == '\n')
+        {
+            if (c->linelen > 0)
+            {
+                c->line[c->linelen] = '\0';
+                chat_line(st, c->line, now);
+            }
+            c->linelen = 0;
+        }
+        else if (c->linelen >= 0)
+        {
+            c->line[c->linelen++] = buf[i];
+            if (c->linelen == LINE_SZ)
+            {
+                c->linelen = -1;
+            }
+        }
+    }
+}
+
+//read everything pending, returns -1 when the server closed the connection
+//st, when not NULL, gets the chat lines received
+static int drain_conn(conn_t *c, stats_t *st)
+{
+    char buf[16384];
+
+    while (1)
+    {
+        ssize_t n = recv(c->fd, buf, sizeof(buf), 0);
+        if (n == 0)
+        {
+            return -1;
+        }
+        if (n < 0)
+        {
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        }
+        c->welcomed = 1;
+        if (st)
+        {
+            chat_input(c, st, buf, n);
+        }
+    }
+}
+
+//write a line, keeping what the socket does not take for when it drains
+//returns -1 if the socket is gone or still has an earlier line to finish
+static int send_line(conn_t *c, int epfd, const char *line)
+{
+    size_t len = strlen(line);
+    if (c->outlen)
+    {
+        return -1;
+    }
+    ssize_t n = send(c->fd, line, len, 0);
+    if (n == (ssize_t)len)
+    {
+        return 0;
+    }
+    if (n < 0)
+    {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+        {
+            return -1;
+        }
+        n = 0;
+    }
+    memcpy(c->out, line + n, len - n);
+    c->outlen = len - n;
+    struct epoll_event ev = { .events = EPOLLIN | EPOLLOUT, .data.ptr = c };
+    epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev);
+    return 0;
+}
+
+//send what the socket takes of a connection's unsent tail, and stop watching
+//for it to drain once it is all gone; returns -1 if the socket is gone
+static int conn_flush(conn_t *c, int epfd)
+{
+    while (c->outlen)
+    {
+        ssize_t n = send(c->fd, c->out, c->outlen, 0);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        }
+        c->outlen -= n;
+        memmove(c->out, c->out + n, c->outlen);
+    }
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = c };
+    epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev);
+    return 0;
+}
+
+//open every connection and wait until the server greets them
+//returns the number of connections welcomed
+static int connect_all(conn_t *conns, int nconns, int epfd)
+{
+    struct epoll_event events[MAX_EVENTS];
+    int welcomed = 0;
+    double start = now_ms();
+
+    for (int i = 0; i < nconns; i++)
+    {
+        conns[i].welcomed = 0;
+        conns[i].sent = 0;
+        conns[i].linelen = 0;
+        conns[i].outlen = 0;
+        conns[i].fd = open_conn();
+        if (conns[i].fd < 0)
+        {
+            continue;
+        }
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &conns[i] };
+        epoll_ctl(epfd, EPOLL_CTL_ADD, conns[i].fd, &ev);
+    }
+
+    while (welcomed < nconns && now_ms() - start < WAVE_TIMEOUT_MS)
+    {
+        int n = epoll_wait(epfd, events, MAX_EVENTS, 100);
+        for (int i = 0; i < n; i++)
+        {
+            conn_t *c = (conn_t *)events[i].data.ptr;
+            int was = c->welcomed;
+            if (drain_conn(c, NULL) < 0)
+            {
+                close(c->fd);   //refused or dropped, counts as not welcomed
+                c->fd = -1;
+                continue;
+            }
+            if (!was && c->welcomed)
+            {
+                welcomed++;
+            }
+        }
+    }
+    return welcomed;
+}
+
+//drop every connection at once; reset instead of FIN so the next run
+//does not run out of ephemeral ports stuck in TIME_WAIT
+static void close_all(conn_t *conns, int nconns)
+{
+    struct linger lg = { .l_onoff = 1, .l_linger = 0 };
+    for (int i = 0; i < nconns; i++)
+    {
+        if (conns[i].fd >= 0)
+        {
+            setsockopt(conns[i].fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+            close(conns[i].fd);
+            conns[i].fd = -1;
+        }
+    }
+}
+
+//one reconnect wave, returns the number of connections welcomed
+static int wave(conn_t *conns, int nconns, int epfd, double *elapsed)
+{
+    double start = now_ms();
+    int welcomed = connect_all(conns, nconns, epfd);
+    *elapsed = now_ms() - start;
+    close_all(conns, nconns);
+    return welcomed;
+}
+
+//read whatever arrived within timeout_ms and finish lines the sockets took
+//only in part, closing connections the server dropped
+//returns the number of connections that had something
+static int poll_conns(int epfd, int timeout_ms, stats_t *st)
+{
+    struct epoll_event events[MAX_EVENTS];
+    int n = epoll_wait(epfd, events, MAX_EVENTS, timeout_ms);
+
+    for (int i = 0; i < n; i++)
+    {
+        conn_t *c = (conn_t *)events[i].data.ptr;
+        if (drain_conn(c, st) < 0 || ((events[i].events & EPOLLOUT) && conn_flush(c, epfd) < 0))
+        {
+            close(c->fd);
+            c->fd = -1;
+        }
+    }
+    return n;
+}
+
+static int cmp_uint(const void *a, const void *b)
+{
+    unsigned int x = *(const unsigned int *)a, y = *(const unsigned int *)b;
+    return x < y ? -1 : x > y;
+}
+
+//latency at quantile q of the sorted samples
+static unsigned int percentile(const stats_t *st, double q)
+{
+    return st->nlat ? st->lat[(size_t)(q * (st->nlat - 1))] : 0;
+}
+
+//chat run: nrooms rooms, rate lines per second per connection for secs seconds
+static void chat(conn_t *conns, int nconns, int epfd, int nrooms, double rate, int secs, int quiet)
+{
+    char line[64];
+    long sent = 0;
+    stats_t st = { 0 };
+
+    int ok = connect_all(conns, nconns, epfd);
+    for (int i = 0; i < nconns; i++)
+    {
+        if (conns[i].fd >= 0)
+        {
+            int one = 1;
+            setsockopt(conns[i].fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            snprintf(line, sizeof(line), "/room %d\r\n", 1 + i % nrooms);
+            send_line(&conns[i], epfd, line);
+        }
+    }
+    //every room change is announced to everybody, wait until that is over
+    double t = now_ms(), last = t;
+    while (now_ms() - last < QUIET_MS && now_ms() - t < SETTLE_MS)
+    {
+        if (poll_conns(epfd, TICK_MS, NULL) > 0)
+        {
+            last = now_ms();
+        }
+    }
+
+    //every line carries its send time in microseconds
+    double start = now_ms(), elapsed;
+    while ((elapsed = now_ms() - start) < secs * 1000.0)
+    {
+        for (int i = 0; i < nconns; i++)
+        {
+            //stagger the connections over the send period instead of bursting in step
+            long due = (long)(elapsed * rate / 1000.0 + (double)i / nconns);
+            while (conns[i].fd >= 0 && conns[i].sent < due)
+            {
+                snprintf(line, sizeof(line), "bench %d %ld %lld\r\n", i, conns[i].sent, now_us());
+                if (send_line(&conns[i], epfd, line) < 0)
+                {
+                    break;      //still finishing a line, the server is behind
+                }
+                conns[i].sent++;
+                sent++;
+            }
+        }
+        poll_conns(epfd, TICK_MS, &st);
+    }
+    elapsed = now_ms() - start;
+    close_all(conns, nconns);
+    qsort(st.lat, st.nlat, sizeof(unsigned int), cmp_uint);
+
+    if (!quiet)
+    {
+        printf("chat: %d connections (%d welcomed), %d rooms, %g lines/s each, %d s\n",
+               nconns, ok, nrooms, rate, secs);
+        printf("%10s %12s %9s %9s %9s %9s\n", "sent/s", "delivered/s", "p50 us", "p99 us", "p999 us", "max us");
+    }
+    printf("%10.0f %12.0f %9u %9u %9u %9u\n", sent / (elapsed / 1000.0), st.delivered / (elapsed / 1000.0),
+           percentile(&st, 0.5), percentile(&st, 0.99), percentile(&st, 0.999), percentile(&st, 1.0));
+    free(st.lat);
+}
+
+//stall run: nconns connections talk in the default room at rate lines per
+//second each for secs seconds while one more in it reads nothing; returns 0
+//when the server dropped that one
+static int stall(conn_t *conns, int nconns, int epfd, double rate, int secs)
+{
+    char line[201];
+    char buf[16384];
+
+    int reader = socket(AF_INET, SOCK_STREAM, 0);
+    int small = STALL_RCVBUF;
+    setsockopt(reader, SOL_SOCKET, SO_RCVBUF, &small, sizeof(small));  //before connect, so the window stays small
+    if (reader < 0 || connect(reader, (struct sockaddr *)&server, sizeof(server)) < 0)
+    {
+        perror("connect");
+        return -1;
+    }
+    int ok = connect_all(conns, nconns, epfd);
+    printf("stall: 1 reader that never reads, %d of %d talkers welcomed, %g lines/s each, %d s\n",
+           ok, nconns, rate, secs);
+
+    memset(line, 'x', sizeof(line) - 1);
+    memcpy(line + sizeof(line) - 3, "\r\n", 3);
+    long sent = 0;
+    double start = now_ms(), elapsed;
+    while ((elapsed = now_ms() - start) < secs * 1000.0)
+    {
+        for (int i = 0; i < nconns; i++)
+        {
+            long due = (long)(elapsed * rate / 1000.0);
+            while (conns[i].fd >= 0 && conns[i].sent < due && send_line(&conns[i], epfd, line) == 0)
+            {
+                conns[i].sent++;
+                sent++;
+            }
+        }
+        poll_conns(epfd, TICK_MS, NULL);    //the talkers read each other, only the reader stalls
+    }
+    close_all(conns, nconns);
+
+    //a reader the server dropped gets what was in flight and then the end;
+    //one still connected goes quiet without it
+    fcntl(reader, F_SETFL, O_NONBLOCK);
+    long got = 0;
+    double last = now_ms();
+    ssize_t n = -1;
+    while (now_ms() - last < QUIET_MS)
+    {
+        n = recv(reader, buf, sizeof(buf), 0);
+        if (n > 0)
+        {
+            got += n;
+            last = now_ms();
+            continue;
+        }
+        if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+        {
+            break;
+        }
+        usleep(TICK_MS * 1000);
+    }
+    close(reader);
+    int dropped = n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR);
+    printf("stall: %ld lines sent, reader got %ld bytes and was %s\n", sent, got,
+           dropped ? "disconnected" : "still connected");
+    return dropped ? 0 : -1;
+}
+
+//FNV-1a hash of a line's text, never 0
+static uint64_t text_hash(const char *s, size_t n)
+{
+    uint64_t h = 1469598103934665603ULL;
+    for (size_t i = 0; i < n; i++)
+    {
+        h = (h ^ (unsigned char)s[i]) * 1099511628211ULL;
+    }
+    return h | 1;
+}
+
+//remember when a replayed line was sent if the server passes its text on:
+//chat lines and the text of whispers
+static void sent_line(session_t *s, const char *line, size_t len, long long now)
+{
+    if (len >= 9 && !memcmp(line, "/whisper ", 9))
+    {
+        size_t i = 9;
+        whispers_sent++;
+        while (i < len && line[i] == ' ')
+        {
+            i++;
+        }
+        while (i < len && line[i] != ' ')
+        {
+            i++;                //the uid
+        }
+        while (i < len && line[i] == ' ')
+        {
+            i++;
+        }
+        line += i;
+        len -= i;
+    }
+    else if (line[0] == '/')
+    {
+        s->binary = len == 7 && !memcmp(line, "/binary", 7);
+        return;
+    }
+    if (len)
+    {
+        uint64_t h = text_hash(line, len);
+        sent_hash[h & (SENT_BUCKETS - 1)] = h;
+        sent_us[h & (SENT_BUCKETS - 1)] = now;
+    }
+}
+
+//queue input for a session and note the lines it holds
+static int session_queue(session_t *s, const char *data, size_t n)
+{
+    long long now = now_us();
+
+    if (s->outlen + n > s->outcap)
+    {
+        size_t cap = (s->outlen + n) * 2;
+        char *out = realloc(s->out, cap);
+        if (!out)
+        {
+            return -1;
+        }
+        s->out = out;
+        s->outcap = cap;
+    }
+    memcpy(s->out + s->outlen, data, n);
+    s->outlen += n;
+
+    for (size_t i = 0; i < n && !s->binary; i++)
+    {
+        if (data[i] == '\n')
+        {
+            if (s->sentlen > 0)
+            {
+                sent_line(s, s->sent, s->sent[s->sentlen - 1] == '\r' ? s->sentlen - 1 : s->sentlen, now);
+            }
+            s->sentlen = 0;
+        }
+        else if (s->sentlen >= 0)
+        {
+            s->sent[s->sentlen++] = data[i];
+            if (s->sentlen == LINE_SZ)
+            {
+                s->sentlen = -1;
+            }
+        }
+    }
+    return 0;
+}
+
+//send what the socket takes of a session's queued input, watching for it to
+//drain when it does not take it all; closes the session once it is done with
+static void session_flush(session_t *s, int epfd)
+{
+    while (s->outlen)
+    {
+        ssize_t n = send(s->c.fd, s->out, s->outlen, 0);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ENOTCONN)
+            {
+                s->outlen = 0;  //the server dropped it
+            }
+            break;
+        }
+        s->outlen -= n;
+        memmove(s->out, s->out + n, s->outlen);
+    }
+    if (s->closing && !s->outlen)
+    {
+        close(s->c.fd);
+        s->c.fd = -1;
+        return;
+    }
+    struct epoll_event ev = { .events = EPOLLIN | (s->outlen ? EPOLLOUT : 0), .data.ptr = s };
+    epoll_ctl(epfd, EPOLL_CTL_MOD, s->c.fd, &ev);
+}
+
+static int cmp_u32(const void *a, const void *b);
+
+//match a received line to the replayed line it delivers, and check that the
+//uids in join notices are those of the capture
+static void replay_line(stats_t *st, const char *line, int len, long long now)
+{
+    const char *p;
+    unsigned int u;
+
+    //the greeting's prompt runs into the first notice, ">[uid] has joined"
+    if (sscanf(line + (line[0] == '>'), "[%u] has joined", &u) == 1 && !foreign_uid &&
+        !bsearch(&u, capture_uids, capture_nuids, sizeof(uint32_t), cmp_u32))
+    {
+        foreign_uid = u;
+        return;
+    }
+    if (len < 4 || memcmp(line, "> [", 3) || !(p = strstr(line, "] ")))
+    {
+        return;
+    }
+    p += 2;
+    len -= p - line;
+    if (len > 0 && p[len - 1] == '\r')
+    {
+        len--;
+    }
+    uint64_t h = text_hash(p, len);
+    int b = h & (SENT_BUCKETS - 1);
+    if (sent_hash[b] == h && now - sent_us[b] < MATCH_MS * 1000LL)
+    {
+        lat_add(st, now - sent_us[b]);
+    }
+}
+
+//read what a session got, returns -1 when the server closed it
+static int session_drain(session_t *s, stats_t *st)
+{
+    char buf[16384];
+    conn_t *c = &s->c;
+
+    while (1)
+    {
+        ssize_t n = recv(c->fd, buf, sizeof(buf), 0);
+        if (n == 0)
+        {
+            return -1;
+        }
+        if (n < 0)
+        {
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        }
+        long long now = now_us();
+        for (ssize_t i = 0; i < n && !s->binary; i++)
+        {
+            if (buf[i] == '\n')
+            {
+                if (c->linelen > 0)
+                {
+                    c->line[c->linelen] = '\0';
+                    replay_line(st, c->line, c->linelen, now);
+                }
+                c->linelen = 0;
+            }
+            else if (c->linelen >= 0)
+            {
+                c->line[c->linelen++] = buf[i];
+                if (c->linelen == LINE_SZ)
+                {
+                    c->linelen = -1;
+                }
+            }
+        }
+    }
+}
+
+static int cmp_rec(const void *a, const void *b)
+{
+    const replay_rec_t *x = a, *y = b;
+    if (x->ns != y->ns)
+    {
+        return x->ns < y->ns ? -1 : 1;
+    }
+    return x->seq - y->seq;
+}
+
+static int cmp_u32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+//load a capture file, its records in time order and the uids of its sessions
+//returns the number of records, -1 on error
+static int load_capture(const char *path, char **file, replay_rec_t **recs, uint32_t **uids, int *nuids)
+{
+    FILE *f = fopen(path, "rb");
+    size_t head = sizeof(CAPTURE_MAGIC) - 1 + sizeof(uint64_t);
+    long size;
+
+    if (!f || fseek(f, 0, SEEK_END) < 0 || (size = ftell(f)) < 0 || fseek(f, 0, SEEK_SET) < 0)
+    {
+        perror(path);
+        if (f)
+        {
+            fclose(f);
+        }
+        return -1;
+    }
+    *file = malloc(size + 1);
+    if (!*file || fread(*file, 1, size, f) != (size_t)size || (size_t)size < head ||
+        memcmp(*file, CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC) - 1))
+    {
+        fprintf(stderr, "%s is not a capture file\n", path);
+        fclose(f);
+        return -1;
+    }
+    fclose(f);
+
+    int n = 0, cap = 0;
+    *recs = NULL;
+    for (size_t off = head; off + sizeof(capture_rec_t) <= (size_t)size; )
+    {
+        capture_rec_t cr;
+        memcpy(&cr, *file + off, sizeof(cr));
+        if (off + sizeof(cr) + cr.len > (size_t)size)
+        {
+            break;              //cut short while the server was writing it
+        }
+        if (n == cap)
+        {
+            cap = cap ? cap * 2 : 1 << 16;
+            replay_rec_t *more = realloc(*recs, cap * sizeof(replay_rec_t));
+            if (!more)
+            {
+                perror("realloc");
+                return -1;
+            }
+            *recs = more;
+        }
+        replay_rec_t *r = &(*recs)[n];
+        r->ns = cr.ns;
+        r->seq = n;
+        r->session = cr.uid;    //mapped to an index below
+        r->kind = cr.kind;
+        r->len = cr.len;
+        r->data = *file + off + sizeof(cr);
+        n++;
+        off += sizeof(cr) + cr.len;
+    }
+    qsort(*recs, n, sizeof(replay_rec_t), cmp_rec);
+
+    *uids = malloc((n ? n : 1) * sizeof(uint32_t));
+    if (!*uids)
+    {
+        perror("malloc");
+        return -1;
+    }
+    *nuids = 0;
+    for (int i = 0; i < n; i++)
+    {
+        (*uids)[i] = (*recs)[i].session;
+    }
+    qsort(*uids, n, sizeof(uint32_t), cmp_u32);
+    for (int i = 0; i < n; i++)
+    {
+        if (!*nuids || (*uids)[*nuids - 1] != (*uids)[i])
+        {
+            (*uids)[(*nuids)++] = (*uids)[i];
+        }
+    }
+    for (int i = 0; i < n; i++)
+    {
+        uint32_t uid = (*recs)[i].session;
+        (*recs)[i].session = (uint32_t *)bsearch(&uid, *uids, *nuids, sizeof(uint32_t), cmp_u32) - *uids;
+    }
+    return n;
+}
+
+//open a session's connection unless it is open already
+static void session_open(session_t *s, int epfd)
+{
+    if (s->c.fd >= 0)
+    {
+        return;
+    }
+    s->c.fd = open_conn();
+    s->c.linelen = 0;
+    s->closing = 0;
+    s->binary = 0;
+    s->sentlen = 0;
+    s->outlen = 0;
+    if (s->c.fd >= 0)
+    {
+        int one = 1;
+        setsockopt(s->c.fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        struct epoll_event ev = { .events = EPOLLIN | EPOLLOUT, .data.ptr = s };
+        epoll_ctl(epfd, EPOLL_CTL_ADD, s->c.fd, &ev);
+    }
+}
+
+//results of a replay: seconds, lines sent/s, delivered/s and latency percentiles
+#define NRESULTS 7
+static const char *result_names[NRESULTS] = { "secs", "sent/s", "delivered/s", "p50 us", "p99 us", "p999 us", "max us" };
+static const int result_widths[NRESULTS] = { 9, 10, 12, 9, 9, 9, 9 };
+
+static void print_result(const char *label, const double *res)
+{
+    printf("%-9s", label);
+    for (int i = 0; i < NRESULTS; i++)
+    {
+        printf(" %*.*f", result_widths[i], i == 0 ? 2 : 0, res[i]);
+    }
+    printf("\n");
+}
+
+//print results, and their change against those saved in baseline
+static void report(const double *res, const char *baseline, int quiet)
+{
+    double was[NRESULTS];
+    FILE *f = baseline ? fopen(baseline, "r") : NULL;
+    int ok = f != NULL;
+
+    for (int i = 0; !quiet && i <= NRESULTS; i++)
+    {
+        i ? printf(" %*s", result_widths[i - 1], result_names[i - 1]) : printf("%-9s", "");
+    }
+    if (!quiet)
+    {
+        printf("\n");
+    }
+    print_result("this run", res);
+    for (int i = 0; ok && i < NRESULTS; i++)
+    {
+        ok = fscanf(f, "%lf", &was[i]) == 1;
+    }
+    if (f)
+    {
+        fclose(f);
+    }
+    if (baseline && !ok)
+    {
+        fprintf(stderr, "cannot read baseline %s\n", baseline);
+        return;
+    }
+    if (baseline)
+    {
+        print_result("baseline", was);
+        printf("%-9s", "change");
+        for (int i = 0; i < NRESULTS; i++)
+        {
+            printf(" %+*.1f%%", result_widths[i] - 1, was[i] ? (res[i] - was[i]) * 100 / was[i] : 0);
+        }
+        printf("\n");
+    }
+}
+
+//replay a capture at speed times its pace, as fast as possible when speed is 0
+static int replay(const char *path, int epfd, double speed, const char *save, const char *baseline, int quiet)
+{
+    char *file;
+    replay_rec_t *recs;
+    uint32_t *uids;
+    int nsessions;
+    int nrecs = load_capture(path, &file, &recs, &uids, &nsessions);
+    stats_t st = { 0 };
+    long sent = 0;
+
+    if (nrecs < 0)
+    {
+        return -1;
+    }
+    session_t *sessions = calloc(nsessions ? nsessions : 1, sizeof(session_t));
+    if (!sessions)
+    {
+        perror("calloc");
+        return -1;
+    }
+    for (int i = 0; i < nsessions; i++)
+    {
+        sessions[i].c.fd = -1;
+    }
+    capture_uids = uids;
+    capture_nuids = nsessions;
+
+    double start = now_ms(), last = start, done = 0;
+    int next = 0;
+    while (1)
+    {
+        double elapsed = now_ms() - start;
+        for (; next < nrecs && (speed <= 0 || recs[next].ns / 1e6 / speed <= elapsed); next++)
+        {
+            replay_rec_t *r = &recs[next];
+            session_t *s = &sessions[r->session];
+            if (r->kind == CAPTURE_CLOSE)
+            {
+                if (s->c.fd >= 0 && speed > 0)  //flat out, sessions stay to see what they were sent
+                {
+                    s->closing = 1;
+                    session_flush(s, epfd);
+                }
+                continue;
+            }
+            session_open(s, epfd);
+            if (r->kind == CAPTURE_DATA && s->c.fd >= 0)
+            {
+                for (int i = 0; i < r->len; i++)
+                {
+                    sent += r->data[i] == '\n';
+                }
+                if (session_queue(s, r->data, r->len) == 0)
+                {
+                    session_flush(s, epfd);
+                }
+            }
+            last = now_ms();
+        }
+
+        //wait for the next record, after the last one until the server falls quiet
+        int timeout = TICK_MS;
+        if (next < nrecs && speed > 0)
+        {
+            double due = recs[next].ns / 1e6 / speed - (now_ms() - start);
+            timeout = due < TICK_MS ? (due > 0 ? (int)due : 0) : TICK_MS;
+        }
+        else if (next < nrecs)
+        {
+            timeout = 0;
+        }
+        struct epoll_event events[MAX_EVENTS];
+        int n = epoll_wait(epfd, events, MAX_EVENTS, timeout);
+        for (int i = 0; i < n; i++)
+        {
+            session_t *s = (session_t *)events[i].data.ptr;
+            if ((events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) && session_drain(s, &st) < 0)
+            {
+                close(s->c.fd);
+                s->c.fd = -1;
+                continue;
+            }
+            if (events[i].events & EPOLLOUT)
+            {
+                session_flush(s, epfd);
+            }
+        }
+        if (n > 0)
+        {
+            last = now_ms();
+        }
+        if (next == nrecs && !done)
+        {
+            done = now_ms();
+        }
+        if (done && (now_ms() - last >= QUIET_MS || now_ms() - done >= SETTLE_MS))
+        {
+            break;              //everything replayed and the server went quiet
+        }
+    }
+
+    for (int i = 0; i < nsessions; i++)
+    {
+        if (sessions[i].c.fd >= 0)
+        {
+            close(sessions[i].c.fd);
+        }
+        free(sessions[i].out);
+    }
+    qsort(st.lat, st.nlat, sizeof(unsigned int), cmp_uint);
+
+    double secs = (last - start) / 1000.0;
+    if (secs <= 0)
+    {
+        secs = 1e-3;
+    }
+    double res[NRESULTS] = { secs, sent / secs, st.delivered / secs, percentile(&st, 0.5), percentile(&st, 0.99),
+                             percentile(&st, 0.999), percentile(&st, 1.0) };
+    if (!quiet)
+    {
+        printf("replay: %d sessions, %d records, ", nsessions, nrecs);
+        speed > 0 ? printf("%gx speed\n", speed) : printf("as fast as possible\n");
+    }
+    report(res, baseline, quiet);
+    if (foreign_uid && whispers_sent)
+    {
+        fprintf(stderr, "warning: the server handed out uid %u, which the capture does not have; "
+                        "%ld whispers were sent to captured uids and may have reached other users or nobody. "
+                        "Replay against a freshly started server\n", foreign_uid, whispers_sent);
+    }
+    if (save)
+    {
+        FILE *f = fopen(save, "w");
+        for (int i = 0; f && i < NRESULTS; i++)
+        {
+            fprintf(f, "%f\n", res[i]);
+        }
+        if (!f || fclose(f) != 0)
+        {
+            perror(save);
+        }
+    }
+    free(st.lat);
+    free(sessions);
+    free(uids);
+    free(recs);
+    free(file);
+    return 0;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-h host] [-p port] [-c connections] [-w waves] reconnect\n"
+                    "       %s [-h host] [-p port] [-c connections] [-r rooms] [-m lines/s] [-d seconds] [-q] chat\n"
+                    "       %s [-h host] [-p port] [-c connections] [-m lines/s] [-d seconds] stall\n"
+                    "       %s [-h host] [-p port] [-x speed, 0 as fast as possible] [-o save results] [-B baseline results] [-q] replay capture\n",
+            prog, prog, prog, prog);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *host = "127.0.0.1";
+    int port = 6667;
+    int nconns = 2000;
+    int nwaves = 3;
+    int nrooms = 5;
+    double rate = 10;
+    int secs = 5;
+    int quiet = 0;
+    double speed = 1;
+    const char *save = NULL;
+    const char *baseline = NULL;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "h:p:c:w:r:m:d:qx:o:B:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'h':
+            host = optarg;
+            break;
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 'c':
+            nconns = atoi(optarg);
+            break;
+        case 'w':
+            nwaves = atoi(optarg);
+            break;
+        case 'r':
+            nrooms = atoi(optarg);
+            break;
+        case 'm':
+            rate = atof(optarg);
+            break;
+        case 'd':
+            secs = atoi(optarg);
+            break;
+        case 'q':
+            quiet = 1;
+            break;
+        case 'x':
+            speed = atof(optarg);
+            break;
+        case 'o':
+            save = optarg;
+            break;
+        case 'B':
+            baseline = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind >= argc || nconns < 1 || nrooms < 1 || rate <= 0)
+    {
+        usage(argv[0]);
+    }
+    int chat_mode = !strcmp(argv[optind], "chat");
+    int replay_mode = !strcmp(argv[optind], "replay");
+    int stall_mode = !strcmp(argv[optind], "stall");
+    if ((!chat_mode && !replay_mode && !stall_mode && strcmp(argv[optind], "reconnect") != 0) ||
+        (replay_mode && optind + 1 >= argc))
+    {
+        usage(argv[0]);
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0)
+    {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    memset(&server, 0, sizeof(server));
+    server.sin_family = AF_INET;
+    server.sin_port = htons(port);
+    if (inet_pton(AF_INET, host, &server.sin_addr) != 1)
+    {
+        fprintf(stderr, "bad address %s\n", host);
+        return EXIT_FAILURE;
+    }
+
+    conn_t *conns = calloc(nconns, sizeof(conn_t));
+    int epfd = epoll_create1(0);
+    if (!conns || epfd < 0)
+    {
+        perror("setup");
+        return EXIT_FAILURE;
+    }
+
+    if (replay_mode)
+    {
+        int ret = replay(argv[optind + 1], epfd, speed, save, baseline, quiet);
+        close(epfd);
+        free(conns);
+        return ret < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+    if (stall_mode)
+    {
+        int ret = stall(conns, nconns, epfd, rate, secs);
+        close(epfd);
+        free(conns);
+        return ret < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+    if (chat_mode)
+    {
+        chat(conns, nconns, epfd, nrooms, rate, secs, quiet);
+        close(epfd);
+        free(conns);
+        return EXIT_SUCCESS;
+    }
+
+    printf("reconnect: %d connections, %d waves\n", nconns, nwaves);
+    printf("%6s %10s %10s %12s\n", "wave", "welcomed", "ms", "accepts/s");
+    for (int w = 1; w <= nwaves; w++)
+    {
+        double elapsed;
+        int ok = wave(conns, nconns, epfd, &elapsed);
+        printf("%6d %10d %10.1f %12.0f\n", w, ok, elapsed, ok / (elapsed / 1000.0));
+        fflush(stdout);
+        usleep(200000);     //let the server process the disconnects
+    }
+
+    close(epfd);
+    free(conns);
+    return EXIT_SUCCESS;
+}